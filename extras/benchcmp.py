@@ -0,0 +1,26 @@
+#!/usr/bin/env python3
+# Compare two `mnemo-bench --json` runs, e.g. from two commits
+import argparse
+import json
+
+def load(f):
+    return {r["bench"]: r for r in map(json.loads, f) if r}
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("old", help="baseline results", type=argparse.FileType('r'))
+    parser.add_argument("new", help="new results", type=argparse.FileType('r'))
+    parser.add_argument("--threshold", "-t", help="flag changes above this percentage", type=float, default=5.0)
+    args = parser.parse_args()
+    old, new = load(args.old), load(args.new)
+    print("%-16s %12s %12s %9s" % ("bench", "old ns/B", "new ns/B", "change"))
+    for name in old:
+        if name not in new: continue
+        a, b = old[name]["ns_per_byte_median"], new[name]["ns_per_byte_median"]
+        change = 100.0 * (b - a) / a if a else 0.0
+        # Only flag changes bigger than the noise of either run
+        noise = 100.0 * max(old[name]["ns_per_byte_stddev"], new[name]["ns_per_byte_stddev"]) / a if a else 0.0
+        flag = ""
+        if abs(change) > max(args.threshold, noise):
+            flag = "slower" if change > 0 else "faster"
+        print("%-16s %12.4f %12.4f %+8.1f%% %s" % (name, a, b, change, flag))
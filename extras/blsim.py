@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Simulated Mnemo bootloader on a unix socket, for `mnemo update unix:<sock> ...`
+import argparse
+import os
+import socket
+import sys
+import time
+
+FLASH_SIZE = 0x20000
+ERASE_ROW = 0x80
+# bl_version answer after the echoed frame: version 0x0102, packet 0x80, device id 0x1234, erase row 0x80, latches 0x80
+VERSION = bytes([0x01, 0x02, 0x00, 0x80, 0, 0, 0x12, 0x34, 0, 0, ERASE_ROW, 0x80, 0, 0, 0, 0])
+
+def cksum(data):
+    a = b = 0
+    for i in range(0, len(data) - 1, 2):
+        s = a + data[i]
+        a, b = s % 256, (b + data[i + 1] + (s >= 256)) % 256
+    return (a << 8) | b
+
+class Connection:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+
+    def need(self, n):
+        while len(self.buf) < n:
+            data = self.sock.recv(65536)
+            if not data:
+                raise EOFError
+            self.buf += data
+        out, self.buf = self.buf[:n], self.buf[n:]
+        return out
+
+def serve(conn, args, flash, state):
+    while True:
+        frame = conn.need(1)
+        if frame[0] != 0x55:
+            continue
+        frame += conn.need(9)
+        cmd, size = frame[1], frame[2] | frame[3] << 8
+        addr = frame[6] | frame[7] << 8 | frame[8] << 16
+        if args.delay:
+            time.sleep(args.delay / 1000)
+        if cmd == 0x00:
+            conn.sock.sendall(frame + VERSION)
+        elif cmd == 0x02:
+            data = conn.need(size)
+            state["writes"] += 1
+            n = state["writes"]
+            if args.drop and n % args.drop == 0:
+                print("drop", hex(addr), file=sys.stderr)
+                continue
+            if args.partial and n % args.partial == 0:
+                # Five payload bytes lost on the line, the device eats the start of the next frame
+                data = data[:-5] + conn.need(5)
+                print("partial", hex(addr), file=sys.stderr)
+            if args.corrupt and n % args.corrupt == 0:
+                data = bytes([data[0] ^ (0x10 + n % 7)]) + data[1:]
+                print("corrupt", hex(addr), file=sys.stderr)
+            flash[addr:addr + size] = bytes(a & b for a, b in zip(flash[addr:addr + size], data))
+            conn.sock.sendall(frame + b'\x01')
+        elif cmd == 0x03:
+            if args.erase_ms:
+                time.sleep(size * args.erase_ms / 1000)
+            flash[addr:addr + size * ERASE_ROW] = b'\xff' * (size * ERASE_ROW)
+            conn.sock.sendall(frame + b'\x01')
+        elif cmd == 0x08:
+            s = cksum(flash[addr:addr + size])
+            conn.sock.sendall(frame + bytes([s >> 8, s & 0xff]))
+        # 0x09 reset doesn't answer
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("socket", help="unix socket to listen on")
+    parser.add_argument("--delay", help="ms before each answer", type=float, default=0)
+    parser.add_argument("--erase-ms", help="ms per erased row", type=float, default=0)
+    parser.add_argument("--drop", help="ignore every nth row write", type=int, default=0)
+    parser.add_argument("--corrupt", help="flip bits in every nth row write", type=int, default=0)
+    parser.add_argument("--partial", help="lose bytes of every nth row write", type=int, default=0)
+    args = parser.parse_args()
+
+    try:
+        os.unlink(args.socket)
+    except FileNotFoundError:
+        pass
+    srv = socket.socket(socket.AF_UNIX)
+    srv.bind(args.socket)
+    srv.listen(8)
+    # Flash survives reconnects, like a device that stays in the bootloader
+    flash = bytearray(b'\xff' * FLASH_SIZE)
+    state = {"writes": 0}
+    while True:
+        sock, _ = srv.accept()
+        try:
+            serve(Connection(sock), args, flash, state)
+        except (EOFError, ConnectionResetError, BrokenPipeError):
+            pass
+        sock.close()
@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+# Minimal mnemod client: list, status, import and update through the daemon
+import argparse
+import os
+import socket
+import sys
+
+def connect(path):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(path)
+    return s, s.makefile("rb")
+
+def request(path, line, out=None):
+    s, f = connect(path)
+    s.sendall((line + "\n").encode())
+    while True:
+        reply = f.readline().decode().rstrip("\n")
+        if not reply:
+            print("connection closed", file=sys.stderr)
+            return 1
+        if reply.startswith("data "):
+            out.write(f.read(int(reply[5:])))
+        elif reply.startswith("log "):
+            print(reply[4:])
+        elif reply.startswith("error"):
+            print(reply, file=sys.stderr)
+            return 1
+        else:
+            print(reply)
+            if reply.startswith("ok"):
+                return 0
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--socket", "-s", help="daemon socket", default="/tmp/mnemod.sock")
+    parser.add_argument("request", help="list, rescan, status <tty>, import <tty> <file.raw>, update <tty> <file.hex> [baud]", nargs="+")
+    args = parser.parse_args()
+    if args.request[0] == "import":
+        if len(args.request) != 3:
+            parser.error("import <tty> <file.raw>")
+        with open(args.request[2], "wb") as out:
+            sys.exit(request(args.socket, "import " + args.request[1], out))
+    if args.request[0] == "update" and len(args.request) >= 3:
+        # The daemon opens the file itself, from its own working directory
+        args.request[2] = os.path.abspath(args.request[2])
+    sys.exit(request(args.socket, " ".join(args.request)))
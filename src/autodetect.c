@@ -4,19 +4,20 @@
 #include <IOKit/serial/IOSerialKeys.h>
 #include <IOKit/IOKitLib.h>
 #include <CoreFoundation/CoreFoundation.h>
-char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
+static int find_tty_paths(uint16_t target_vid, uint16_t target_pid, char **paths, int max) {
+    int count = 0;
     CFMutableDictionaryRef matchingDict = IOServiceMatching(kIOSerialBSDServiceValue);
-    if (!matchingDict) return NULL;
+    if (!matchingDict) return 0;
 
     CFDictionarySetValue(matchingDict, CFSTR(kIOSerialBSDTypeKey), CFSTR(kIOSerialBSDAllTypes));
 
     io_iterator_t iter;
     if (IOServiceGetMatchingServices(kIOMainPortDefault, matchingDict, &iter) != KERN_SUCCESS) {
-        return NULL;
+        return 0;
     }
 
     io_object_t device;
-    while ((device = IOIteratorNext(iter))) {
+    while (count < max && (device = IOIteratorNext(iter))) {
         io_registry_entry_t parent = device, next;
         uint16_t vid = 0, pid = 0;
 
@@ -50,12 +51,10 @@ char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
                 CFIndex maxSize = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8) + 1;
                 char *tty_path = malloc(maxSize);
                 if (tty_path && CFStringGetCString((CFStringRef)pathCF, tty_path, maxSize, kCFStringEncodingUTF8)) {
-                    CFRelease(pathCF);
-                    IOObjectRelease(device);
-                    IOObjectRelease(iter);
-                    return tty_path;
+                    paths[count++] = tty_path;
+                } else {
+                    free(tty_path);
                 }
-                free(tty_path);
             }
             if (pathCF) CFRelease(pathCF);
         }
@@ -64,7 +63,7 @@ char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
     }
 
     IOObjectRelease(iter);
-    return NULL;
+    return count;
 }
 #elif __linux__
 #include <dirent.h>
@@ -74,12 +73,13 @@ char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
 
 #define SYS_TTY_PATH "/sys/class/tty"
 
-char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
+static int find_tty_paths(uint16_t target_vid, uint16_t target_pid, char **paths, int max) {
+    int count = 0;
     DIR *dir = opendir(SYS_TTY_PATH);
-    if (!dir) return NULL;
+    if (!dir) return 0;
 
     struct dirent *entry;
-    while ((entry = readdir(dir))) {
+    while (count < max && (entry = readdir(dir))) {
         if (strncmp(entry->d_name, "ttyUSB", 6) != 0 && strncmp(entry->d_name, "ttyACM", 6) != 0)
             continue;
 
@@ -106,12 +106,13 @@ char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
                 fscanf(pidf, "%x", &pid);
                 fclose(vidf);
                 fclose(pidf);
+                vidf = pidf = NULL;
 
                 if (vid == target_vid && pid == target_pid) {
-                    closedir(dir);
                     char *result = malloc(PATH_MAX);
                     snprintf(result, PATH_MAX, "/dev/%s", entry->d_name);
-                    return result;
+                    paths[count++] = result;
+                    break;
                 }
             }
             if (vidf) fclose(vidf);
@@ -125,14 +126,32 @@ char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
     }
 
     closedir(dir);
-    return NULL;
+    return count;
 }
 #else
-char *get_tty_path_for_vid_pid(uint16_t target_vid, uint16_t target_pid) {
-    return NULL;
+static int find_tty_paths(uint16_t target_vid, uint16_t target_pid, char **paths, int max) {
+    return 0;
 }
 #endif
 
+#define MNEMO_VID 0x04d8
+#define MNEMO_PID 0x00dd
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
 char * autodetect() {
-    return get_tty_path_for_vid_pid(0x04d8, 0x00dd);
+    char *paths[AUTODETECT_MAX];
+    int count = autodetect_all(paths, AUTODETECT_MAX);
+    for (int i = 1; i < count; i++) {
+        free(paths[i]);
+    }
+    return count > 0 ? paths[0] : NULL;
+}
+
+int autodetect_all(char **paths, int max) {
+    int count = find_tty_paths(MNEMO_VID, MNEMO_PID, paths, max);
+    qsort(paths, count, sizeof(char *), compare_paths);
+    return count;
 }
\ No newline at end of file
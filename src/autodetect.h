@@ -8,4 +8,9 @@
 // tty path if found, NULL if not found, user must free
 char * autodetect();
 
+#define AUTODETECT_MAX 64
+
+// fills paths with every connected device (sorted), returns count, user must free each
+int autodetect_all(char **paths, int max);
+
 #endif
\ No newline at end of file
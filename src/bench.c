@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "mnemo.h"
+#include "hexfile.h"
+#include "store.h"
+#include "lz.h"
+#include "dump.h"
+
+/*
+    Micro benchmarks for the hot paths, inputs are synthetic and seeded so
+    runs are comparable between commits (extras/benchcmp.py).
+*/
+
+#define MAX_MEMORY (1024 * 1024)
+#define MAX_REPS 1000
+
+static int reps = 20;
+static int warmup = 3;
+static bool json = false;
+static const char *filter = NULL;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// Inputs
+
+static uint8_t *random_bytes(size_t len) {
+    uint8_t *buf = malloc(len);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = rng();
+    }
+    return buf;
+}
+
+static void hex_record(char **out, uint8_t type, uint16_t addr, const uint8_t *data, uint8_t len) {
+    uint8_t sum = len + (addr >> 8) + (addr & 0xff) + type;
+    *out += sprintf(*out, ":%.2X%.4X%.2X", len, addr, type);
+    for (int i = 0; i < len; i++) {
+        *out += sprintf(*out, "%.2X", data[i]);
+        sum += data[i];
+    }
+    *out += sprintf(*out, "%.2X\n", (uint8_t)-sum);
+}
+
+// Intel HEX text for a full image, 16 byte data records like the XC8 output
+static char *hex_image(size_t image_len, size_t *text_len) {
+    uint8_t *image = random_bytes(image_len);
+    char *text = malloc(image_len * 3 + image_len / 16 * 12 + 1024);
+    char *out = text;
+    for (size_t addr = 0; addr < image_len; addr += 16) {
+        if ((addr & 0xffff) == 0) {
+            uint8_t upper[2] = { (addr >> 24) & 0xff, (addr >> 16) & 0xff };
+            hex_record(&out, 0x04, 0, upper, 2);
+        }
+        size_t n = image_len - addr < 16 ? image_len - addr : 16;
+        hex_record(&out, 0x00, addr & 0xffff, image + addr, n);
+    }
+    hex_record(&out, 0x01, 0, NULL, 0);
+    free(image);
+    *text_len = out - text;
+    return text;
+}
+
+// Survey stream: header + slowly drifting shots ending in EOC, like a real dump
+static uint8_t *survey_stream(size_t len, size_t max_shots) {
+    uint8_t *buf = malloc(len);
+    size_t pos = 0;
+    while (pos + 10 + 16 <= len) {
+        uint8_t header[10] = { 0x02, 24, 1 + rng() % 12, 1 + rng() % 28, rng() % 24, rng() % 60, 'A', 'B', 'C', rng() & 1 };
+        memcpy(buf + pos, header, sizeof(header));
+        pos += sizeof(header);
+
+        size_t shots = 1 + rng() % max_shots;
+        int16_t v[7] = { 0 };
+        for (size_t i = 0; i < shots && pos + 16 <= len; i++) {
+            bool last = i + 1 == shots || pos + 32 > len;
+            buf[pos++] = last ? 3 : 2;
+            for (int k = 0; k < 7; k++) {
+                v[k] += (int16_t)(rng() % 41) - 20;
+                buf[pos++] = (v[k] >> 8) & 0xff;
+                buf[pos++] = v[k] & 0xff;
+            }
+            buf[pos++] = 0;
+            if (last) break;
+        }
+    }
+    memset(buf + pos, 0, len - pos);
+    return buf;
+}
+
+// Benchmarks
+
+static uint8_t *memory;
+static char *hex_text;
+static size_t hex_len;
+static uint8_t *random_data;
+static uint8_t *surveys;
+static uint8_t *compressed;
+static size_t compressed_len;
+static uint8_t *scratch;
+static char *dmp_text;
+static size_t dmp_len;
+static int devnull;
+
+#define RANDOM_LEN (1024 * 1024)
+#define SURVEY_LEN (4 * 1024 * 1024)
+#define ENCODE_LEN (64 * 1024)
+
+static volatile uint64_t sink;
+
+static void run_hex_parse(void) {
+    FILE *f = fmemopen(hex_text, hex_len, "r");
+    sink += load_intel_hex(f, memory, MAX_MEMORY);
+    fclose(f);
+}
+
+static void run_bl_calc_cksum(void) {
+    for (size_t i = 0; i < RANDOM_LEN; i += 0xFFF0) {
+        size_t n = RANDOM_LEN - i < 0xFFF0 ? RANDOM_LEN - i : 0xFFF0;
+        sink += bl_calc_cksum(random_data + i, n);
+    }
+}
+
+static void run_dmp_encode(void) {
+    write_dump(devnull, DMP, (char *)random_data, ENCODE_LEN);
+}
+
+static void run_raw_encode(void) {
+    write_dump(devnull, RAW, (char *)random_data, ENCODE_LEN);
+}
+
+static void run_dmp_decode(void) {
+    struct dump_buffer dump = { NULL, 0, 0 };
+    FILE *f = fmemopen(dmp_text, dmp_len, "r");
+    read_dump(f, DMP, &dump);
+    fclose(f);
+    sink += dump.len;
+    free(dump.data);
+}
+
+static void run_survey_split(void) {
+    size_t records = 0;
+    for (size_t off = 0; off < SURVEY_LEN; records++) {
+        off += survey_record_len(surveys + off, SURVEY_LEN - off);
+    }
+    sink += records;
+}
+
+static void run_store_hash(void) {
+    sink += store_hash(surveys, SURVEY_LEN);
+}
+
+static void run_lz_compress(void) {
+    sink += lz_compress(surveys, SURVEY_LEN, scratch, lz_bound(SURVEY_LEN));
+}
+
+static void run_lz_decompress(void) {
+    sink += lz_decompress(compressed, compressed_len, scratch, SURVEY_LEN);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench(const char *name, void (*fn)(void), size_t bytes) {
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+    static double ns[MAX_REPS];
+    for (int i = 0; i < warmup; i++) {
+        fn();
+    }
+    for (int i = 0; i < reps; i++) {
+        uint64_t start = monotonic_ns();
+        fn();
+        ns[i] = (double)(monotonic_ns() - start) / bytes;
+    }
+    qsort(ns, reps, sizeof(double), cmp_double);
+
+    double mean = 0, var = 0;
+    for (int i = 0; i < reps; i++) mean += ns[i];
+    mean /= reps;
+    for (int i = 0; i < reps; i++) var += (ns[i] - mean) * (ns[i] - mean);
+    double stddev = reps > 1 ? sqrt(var / (reps - 1)) : 0;
+    double median = reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+
+    if (json) {
+        printf("{\"bench\":\"%s\",\"bytes\":%zu,\"warmup\":%d,\"reps\":%d,"
+            "\"ns_per_byte_min\":%.4f,\"ns_per_byte_median\":%.4f,\"ns_per_byte_mean\":%.4f,"
+            "\"ns_per_byte_stddev\":%.4f,\"mb_per_s\":%.2f}\n",
+            name, bytes, warmup, reps, ns[0], median, mean, stddev, 1e3 / median);
+    } else {
+        printf("%-16s %9zu %10.3f %10.3f %10.3f %9.3f %10.2f\n",
+            name, bytes, ns[0], median, mean, stddev, 1e3 / median);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s [--json] [--reps <n>] [--warmup <n>] [<filter>]\n"
+        "\n"
+        "Options:\n"
+        "  --json             One JSON object per benchmark (for extras/benchcmp.py)\n"
+        "  --reps <n>         Timed repetitions (default: 20)\n"
+        "  --warmup <n>       Untimed repetitions before measuring (default: 3)\n",
+        progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct option longopts[] = {
+        {"json",   no_argument,       0, 'j'},
+        {"reps",   required_argument, 0, 'r'},
+        {"warmup", required_argument, 0, 'w'},
+        {"help",   no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "jr:w:h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                json = true;
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                if (reps <= 0 || reps > MAX_REPS) usage(argv[0]);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                if (warmup < 0) usage(argv[0]);
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        filter = argv[optind];
+    }
+
+    memory = malloc(MAX_MEMORY);
+    memset(memory, 0xff, MAX_MEMORY);
+    hex_text = hex_image(MAX_MEMORY, &hex_len);
+    random_data = random_bytes(RANDOM_LEN);
+    surveys = survey_stream(SURVEY_LEN, 500);
+    scratch = malloc(lz_bound(SURVEY_LEN));
+    compressed = malloc(lz_bound(SURVEY_LEN));
+    compressed_len = lz_compress(surveys, SURVEY_LEN, compressed, lz_bound(SURVEY_LEN));
+    devnull = open("/dev/null", O_WRONLY);
+
+    char *out = dmp_text = malloc(ENCODE_LEN * 5);
+    for (size_t i = 0; i < ENCODE_LEN; i++) {
+        out += sprintf(out, "%d;", (int8_t)random_data[i]);
+    }
+    dmp_len = out - dmp_text;
+
+    if (!json) {
+        printf("%-16s %9s %10s %10s %10s %9s %10s\n",
+            "bench", "bytes", "ns/B min", "ns/B med", "ns/B mean", "stddev", "MB/s");
+    }
+
+    bench("hex_parse", run_hex_parse, hex_len);
+    bench("bl_calc_cksum", run_bl_calc_cksum, RANDOM_LEN);
+    bench("dmp_encode", run_dmp_encode, ENCODE_LEN);
+    bench("raw_encode", run_raw_encode, ENCODE_LEN);
+    bench("dmp_decode", run_dmp_decode, dmp_len);
+    bench("survey_split", run_survey_split, SURVEY_LEN);
+    bench("store_hash", run_store_hash, SURVEY_LEN);
+    bench("lz_compress", run_lz_compress, SURVEY_LEN);
+    bench("lz_decompress", run_lz_decompress, SURVEY_LEN);
+
+    close(devnull);
+    free(dmp_text);
+    free(compressed);
+    free(scratch);
+    free(surveys);
+    free(random_data);
+    free(hex_text);
+    free(memory);
+    return 0;
+}
@@ -0,0 +1,195 @@
+#include "bundle.h"
+#include "mnemo.h"
+#include "store.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "fw_bundle maps little endian files directly"
+#endif
+
+static bool row_is_blank(const uint8_t *row) {
+    for (int i = 0; i < BUNDLE_ROW_SIZE; i++) {
+        if (row[i] != 0xff) return false;
+    }
+    return true;
+}
+
+// Verify windows step through start..end, the last two bytes are left out
+static uint16_t window_len(uint32_t addr, uint32_t end) {
+    return addr + BUNDLE_WINDOW_SIZE >= end - 2 ? end - addr - 2 : BUNDLE_WINDOW_SIZE;
+}
+
+// Rebuilds the image and checks it against the row, window and image checksums
+static bool bundle_verify(const fw_bundle *b) {
+    const struct bundle_header *h = b->header;
+    uint8_t *memory = malloc(h->end);
+    memset(memory + h->start, 0xff, h->end - h->start);
+    bool ok = true;
+    for (uint32_t i = 0; i < h->row_count && ok; i++) {
+        const uint8_t *row = b->data + (size_t)i * h->row_size;
+        ok = bl_calc_cksum(row, h->row_size) == b->rows[i].cksum;
+        memcpy(memory + b->rows[i].addr, row, h->row_size);
+    }
+    for (uint32_t i = 0; i < h->window_count && ok; i++) {
+        const struct bundle_window *w = &b->windows[i];
+        ok = bl_calc_cksum(memory + w->addr, w->len) == w->cksum;
+    }
+    ok = ok && store_hash(memory + h->start, h->end - h->start) == h->hash;
+    free(memory);
+    return ok;
+}
+
+// Points the tables into buf after checking they fit, -2 if not a valid bundle.
+// verify checks the data against its checksums, not needed for what bundle_from_image just computed
+static int bundle_attach(fw_bundle *b, void *buf, size_t len, bool verify) {
+    const struct bundle_header *h = buf;
+    // flash() erases start..end, anything outside the application area would hit the bootloader
+    if (len < sizeof(*h) || memcmp(h->magic, BUNDLE_MAGIC, 4) != 0 || h->version != BUNDLE_VERSION ||
+        h->row_size != BUNDLE_ROW_SIZE || h->window_size != BUNDLE_WINDOW_SIZE ||
+        h->start < FLASH_START || h->end > FLASH_END || h->start + 2 >= h->end) {
+        return -2;
+    }
+    uint64_t size = sizeof(*h)
+        + (uint64_t)h->row_count * sizeof(struct bundle_row)
+        + (uint64_t)h->window_count * sizeof(struct bundle_window)
+        + (uint64_t)h->row_count * h->row_size;
+    if (size != len) {
+        return -2;
+    }
+
+    b->header = h;
+    b->rows = (const struct bundle_row *)(h + 1);
+    b->windows = (const struct bundle_window *)(b->rows + h->row_count);
+    b->data = (const uint8_t *)(b->windows + h->window_count);
+    b->buf = buf;
+    b->len = len;
+
+    // Sorted and unique, find_row() bisects them
+    for (uint32_t i = 0; i < h->row_count; i++) {
+        uint32_t addr = b->rows[i].addr;
+        if (addr < h->start || addr + h->row_size > h->end || addr % h->row_size != 0 ||
+            (i > 0 && addr <= b->rows[i - 1].addr)) {
+            return -2;
+        }
+    }
+    // Exactly the layout bundle_from_image() writes, so verification covers the whole image
+    uint32_t i = 0;
+    for (uint32_t addr = h->start; addr < h->end - 2; addr += BUNDLE_WINDOW_SIZE, i++) {
+        if (i >= h->window_count || b->windows[i].addr != addr || b->windows[i].len != window_len(addr, h->end)) {
+            return -2;
+        }
+    }
+    if (i != h->window_count) {
+        return -2;
+    }
+    return !verify || bundle_verify(b) ? 0 : -2;
+}
+
+int bundle_from_image(fw_bundle *b, const uint8_t *memory, uint32_t start, uint32_t end) {
+    uint32_t row_count = 0;
+    for (uint32_t addr = start; addr < end; addr += BUNDLE_ROW_SIZE) {
+        if (!row_is_blank(memory + addr)) row_count++;
+    }
+    uint32_t window_count = 0;
+    for (uint32_t addr = start; addr < end - 2; addr += BUNDLE_WINDOW_SIZE) {
+        window_count++;
+    }
+
+    size_t len = sizeof(struct bundle_header)
+        + row_count * sizeof(struct bundle_row)
+        + window_count * sizeof(struct bundle_window)
+        + row_count * BUNDLE_ROW_SIZE;
+    uint8_t *buf = calloc(1, len);
+
+    struct bundle_header *h = (struct bundle_header *)buf;
+    memcpy(h->magic, BUNDLE_MAGIC, 4);
+    h->version = BUNDLE_VERSION;
+    h->row_size = BUNDLE_ROW_SIZE;
+    h->start = start;
+    h->end = end;
+    h->row_count = row_count;
+    h->window_count = window_count;
+    h->window_size = BUNDLE_WINDOW_SIZE;
+    h->hash = store_hash(memory + start, end - start);
+
+    struct bundle_row *rows = (struct bundle_row *)(h + 1);
+    struct bundle_window *windows = (struct bundle_window *)(rows + row_count);
+    uint8_t *data = (uint8_t *)(windows + window_count);
+
+    uint32_t n = 0;
+    for (uint32_t addr = start; addr < end; addr += BUNDLE_ROW_SIZE) {
+        if (row_is_blank(memory + addr)) continue;
+        rows[n].addr = addr;
+        rows[n].cksum = bl_calc_cksum(memory + addr, BUNDLE_ROW_SIZE);
+        memcpy(data + n * BUNDLE_ROW_SIZE, memory + addr, BUNDLE_ROW_SIZE);
+        n++;
+    }
+    n = 0;
+    for (uint32_t addr = start; addr < end - 2; addr += BUNDLE_WINDOW_SIZE) {
+        uint16_t s = window_len(addr, end);
+        windows[n].addr = addr;
+        windows[n].len = s;
+        windows[n].cksum = bl_calc_cksum(memory + addr, s);
+        n++;
+    }
+
+    b->mapped = false;
+    return bundle_attach(b, buf, len, false);
+}
+
+int bundle_write(const fw_bundle *b, const char *file) {
+    FILE *f = fopen(file, "wb");
+    if (!f) return -1;
+    if (fwrite(b->buf, 1, b->len, f) != b->len) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+bool bundle_is_bundle(const char *file) {
+    char magic[4];
+    FILE *f = fopen(file, "rb");
+    if (!f) return false;
+    bool result = fread(magic, 1, 4, f) == 4 && memcmp(magic, BUNDLE_MAGIC, 4) == 0;
+    fclose(f);
+    return result;
+}
+
+int bundle_open(fw_bundle *b, const char *file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct bundle_header)) {
+        close(fd);
+        return -2;
+    }
+    void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) return -1;
+
+    b->mapped = true;
+    int result = bundle_attach(b, buf, st.st_size, true);
+    if (result < 0) {
+        munmap(buf, st.st_size);
+    }
+    return result;
+}
+
+void bundle_free(fw_bundle *b) {
+    if (b->mapped) {
+        munmap(b->buf, b->len);
+    } else {
+        free(b->buf);
+    }
+}
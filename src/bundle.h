@@ -0,0 +1,69 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Precompiled firmware bundle (.mfw), little endian, mapped as is
+
+    header
+    rows[row_count]        address and host checksum of each non blank write row
+    windows[window_count]  address, length and host checksum of each verify window
+    data[row_count * row_size]
+*/
+
+#define BUNDLE_MAGIC "MNFW"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ROW_SIZE 0x80
+#define BUNDLE_WINDOW_SIZE 0xFFF0
+
+// Application flash, the bootloader lives below FLASH_START
+#define FLASH_START 0x800
+#define FLASH_END 0x20000
+
+struct bundle_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t row_size;
+    uint32_t start;
+    uint32_t end;
+    uint32_t row_count;
+    uint32_t window_count;
+    uint32_t window_size;
+    uint32_t reserved;
+    uint64_t hash; // FNV-1a of the image from start to end
+};
+
+struct bundle_row {
+    uint32_t addr;
+    uint16_t cksum;
+    uint16_t reserved;
+};
+
+struct bundle_window {
+    uint32_t addr;
+    uint16_t len;
+    uint16_t cksum;
+};
+
+typedef struct {
+    const struct bundle_header *header;
+    const struct bundle_row *rows;
+    const struct bundle_window *windows;
+    const uint8_t *data;
+    void *buf;
+    size_t len;
+    bool mapped;
+} fw_bundle;
+
+// packs memory[start..end), rows that are all 0xff are left out
+int bundle_from_image(fw_bundle *b, const uint8_t *memory, uint32_t start, uint32_t end);
+int bundle_write(const fw_bundle *b, const char *file);
+// maps file and checks it against its checksums, -1 io error, -2 not a valid bundle
+int bundle_open(fw_bundle *b, const char *file);
+bool bundle_is_bundle(const char *file);
+void bundle_free(fw_bundle *b);
+
+#endif
@@ -0,0 +1,43 @@
+#include "dump.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+void dump_append(struct dump_buffer *dump, const uint8_t *data, size_t len) {
+    if (dump->len + len > dump->cap) {
+        dump->cap = (dump->len + len) * 2;
+        dump->data = realloc(dump->data, dump->cap);
+    }
+    memcpy(dump->data + dump->len, data, len);
+    dump->len += len;
+}
+
+void write_dump(int fd, enum import_format format, const char *buf, int n) {
+    for (int i = 0; i < n; i++) {
+        if(format == RAW) {
+            dprintf(fd, "%c", buf[i]);
+        }
+        else {
+            dprintf(fd, "%d;", buf[i]);
+        }
+    }
+}
+
+int read_dump(FILE *f, enum import_format format, struct dump_buffer *dump) {
+    if (!f) return -1;
+    int c;
+    int value;
+    while (format == RAW ? (c = fgetc(f)) != EOF : fscanf(f, " %d;", &value) == 1) {
+        if (format == DMP && (value < -128 || value > 255)) {
+            return -2;
+        }
+        uint8_t b = format == RAW ? (uint8_t)c : (uint8_t)value;
+        dump_append(dump, &b, 1);
+    }
+    if (ferror(f)) {
+        return -1;
+    }
+    // Only trailing whitespace may be left, anything else would silently truncate the dump
+    while ((c = fgetc(f)) != EOF && isspace(c));
+    return c == EOF ? 0 : -2;
+}
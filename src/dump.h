@@ -0,0 +1,22 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// raw is the bytes as received, dmp is semicolon separated signed bytes (Ariane)
+enum import_format { DMP, RAW };
+
+struct dump_buffer {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+void dump_append(struct dump_buffer *dump, const uint8_t *data, size_t len);
+void write_dump(int fd, enum import_format format, const char *buf, int n);
+// -1 io error, -2 if the file doesn't parse to its end
+int read_dump(FILE *f, enum import_format format, struct dump_buffer *dump);
+
+#endif
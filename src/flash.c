@@ -0,0 +1,318 @@
+#include "flash.h"
+#include "hexfile.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void print_latency(mnemo *dev) {
+    struct transport_stats *s = &dev->io->stats;
+    if (s->round_trips == 0) {
+        return;
+    }
+    printf("Round trips: %u, latency avg %.3f ms (min %.3f, max %.3f)\n",
+        s->round_trips,
+        s->rtt_total_ns / 1e6 / s->round_trips,
+        s->rtt_min_ns / 1e6,
+        s->rtt_max_ns / 1e6);
+    printf("Timeouts: version %d ms, write %d ms, checksum %d ms per window, erase %d ms per 1000 rows\n",
+        bl_timeout(dev, BL_KIND_VERSION, BL_FRAME_LEN * 2 + 16, 0),
+        bl_timeout(dev, BL_KIND_WRITE, BL_FRAME_LEN * 2 + BUNDLE_ROW_SIZE + 1, 1),
+        bl_timeout(dev, BL_KIND_CHECKSUM, BL_FRAME_LEN * 2 + 2, BUNDLE_WINDOW_SIZE),
+        bl_timeout(dev, BL_KIND_ERASE, BL_FRAME_LEN * 2 + 1, 1000));
+}
+
+void print_counters(const struct bl_counters *c) {
+    printf("Retries: %u timeouts, %u out of sync, %u resyncs, %u rows rewritten\n",
+        c->timeouts, c->desyncs, c->resyncs, c->rewritten_rows);
+}
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void flash_log(struct flash_job *job, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (job->log) {
+        char line[256];
+        vsnprintf(line, sizeof(line), fmt, ap);
+        job->log(job->userdata, line);
+        va_end(ap);
+        return;
+    }
+    pthread_mutex_lock(&output_lock);
+    if (job->fleet) {
+        printf("[%s] ", job->tty);
+    }
+    vprintf(fmt, ap);
+    va_end(ap);
+    fflush(stdout);
+    pthread_mutex_unlock(&output_lock);
+}
+
+static int flash_fail(struct flash_job *job, const char *error) {
+    job->error = error;
+    flash_log(job, "%s\n", error);
+    return 1;
+}
+
+#define FLASH_RETRIES 3
+
+// Index of the first bundle row at or above addr
+static uint32_t find_row(const fw_bundle *fw, uint32_t addr) {
+    uint32_t lo = 0, hi = fw->header->row_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (fw->rows[mid].addr < addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+    Resyncs, erases the erase row(s) around addr and writes back the bundle
+    rows in them below upto. Only that part of flash is redone instead of
+    restarting the whole transfer.
+*/
+static int rewrite_rows(mnemo *dev, struct flash_job *job, const BLInfo *info, uint32_t addr, uint32_t upto) {
+    const fw_bundle *fw = job->fw;
+    uint32_t row_size = fw->header->row_size;
+    uint32_t erase_size = info->erase_row_size ? info->erase_row_size : row_size;
+    uint32_t from = addr - addr % erase_size;
+    uint32_t to = (addr + row_size + erase_size - 1) / erase_size * erase_size;
+    if (upto > to) upto = to;
+
+    for (int attempt = 0; attempt < FLASH_RETRIES; attempt++) {
+        if (bl_resync(dev) < 0) {
+            return -1;
+        }
+        if (bl_flash_erase(dev, from, (to - from) / erase_size) < 0) {
+            continue;
+        }
+        uint32_t i = find_row(fw, from);
+        for (; i < fw->header->row_count && fw->rows[i].addr < upto; i++) {
+            if (bl_flash_write(dev, fw->rows[i].addr, fw->data + i * row_size, row_size) < 0) {
+                break;
+            }
+            dev->counters.rewritten_rows++;
+        }
+        if (i == fw->header->row_count || fw->rows[i].addr >= upto) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Finds the rows of a window that don't match and rewrites them
+static int repair_window(mnemo *dev, struct flash_job *job, const BLInfo *info, const struct bundle_window *w) {
+    const fw_bundle *fw = job->fw;
+    uint32_t row_size = fw->header->row_size;
+    uint8_t blank[BUNDLE_ROW_SIZE];
+    memset(blank, 0xff, sizeof(blank));
+    uint16_t blank_cksum = bl_calc_cksum(blank, row_size);
+
+    for (uint32_t addr = w->addr - w->addr % row_size; addr < w->addr + w->len; addr += row_size) {
+        uint32_t i = find_row(fw, addr);
+        bool present = i < fw->header->row_count && fw->rows[i].addr == addr;
+        uint16_t expected = present ? fw->rows[i].cksum : blank_cksum;
+
+        int attempt = 0;
+        int result;
+        while ((result = bl_checksum(dev, addr, row_size)) < 0 && ++attempt < FLASH_RETRIES) {
+            if (bl_resync(dev) < 0) return -1;
+        }
+        if (result < 0) return -1;
+        if (result != expected && rewrite_rows(dev, job, info, addr, UINT32_MAX) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int flash(mnemo *dev, struct flash_job *job) {
+    const struct bundle_header *fw = job->fw->header;
+    bool quiet = job->fleet || job->log;
+    flash_log(job, "Querying bootloader\n");
+    BLInfo info;
+    int result = bl_version(dev, &info);
+    if (result < 0 && bl_resync(dev) == 0) {
+        result = bl_version(dev, &info);
+    }
+    if (result < 0) {
+        return flash_fail(job, "Error getting bootloader version");
+    }
+    job->info = info;
+
+    flash_log(job, "Bootloader version: %x\n", info.bl_version);
+
+    size_t start = fw->start;
+    size_t end = fw->end;
+    size_t total = end - start;
+    size_t erase_rows =  total / info.erase_row_size;
+
+    flash_log(job, "Erasing: (%ld rows of size %d)\n", erase_rows, info.erase_row_size);
+    result = bl_flash_erase(dev, start, erase_rows);
+    for (int attempt = 1; result < 0 && attempt < FLASH_RETRIES; attempt++) {
+        if (bl_resync(dev) == 0) {
+            result = bl_flash_erase(dev, start, erase_rows);
+        }
+    }
+    if (result < 0) {
+        return flash_fail(job, "Error erasing");
+    }
+
+    // Blank rows are left out of the bundle, erased flash already reads 0xff
+    for(uint32_t i = 0; i < fw->row_count; i++) {
+        uint32_t addr = job->fw->rows[i].addr;
+        if (!quiet) {
+            float percent = 100.0f * i / fw->row_count;
+            printf("\r\033[KWriting: 0x%.6x (%.1f%%)", addr, percent);
+            fflush(stdout);
+        }
+        result = bl_flash_write(dev, addr, job->fw->data + i * fw->row_size, fw->row_size);
+        if (result < 0) {
+            // Row may be half written, redo it (and its erase row neighbours written so far)
+            result = rewrite_rows(dev, job, &info, addr, addr + fw->row_size);
+        }
+        if (result < 0) {
+            if (!quiet) printf("\n");
+            return flash_fail(job, "Error writing!");
+        }
+    }
+    if (!quiet) printf("\n");
+
+    flash_log(job, quiet ? "Verifying\n" : "Verifying: ");
+    for(uint32_t i = 0; i < fw->window_count; i++) {
+        const struct bundle_window *w = &job->fw->windows[i];
+        int attempt = 0;
+        while ((result = bl_checksum(dev, w->addr, w->len)) != w->cksum && ++attempt < FLASH_RETRIES) {
+            if (result < 0) {
+                if (bl_resync(dev) < 0) break;
+            } else if (repair_window(dev, job, &info, w) < 0) {
+                break;
+            }
+        }
+        if (result < 0) {
+            return flash_fail(job, "Read error");
+        }
+        if (result != w->cksum) {
+            return flash_fail(job, "Mismatch!");
+        }
+    }
+    if (quiet) {
+        flash_log(job, "Success\n");
+    } else {
+        printf("Success\n");
+    }
+
+    flash_log(job, "Restarting\n");
+    result = bl_reset(dev);
+    if (result < 0) {
+        return flash_fail(job, "Error restarting device");
+    }
+    return 0;
+}
+
+int load_firmware(const char *file, fw_bundle *fw) {
+    if (bundle_is_bundle(file)) {
+        int result = bundle_open(fw, file);
+        if (result == -1) {
+            perror(file);
+        } else if (result < 0) {
+            printf("Invalid firmware bundle\n");
+        }
+        return result < 0 ? 1 : 0;
+    }
+
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        perror("Failed to open firmware file");
+        return 1;
+    }
+
+    #define MAX_MEMORY (1024 * 1024)  // 1 MB buffer
+    uint8_t * memory = malloc(MAX_MEMORY);
+    memset(memory, 0xff, MAX_MEMORY);
+
+    int size = load_intel_hex(f, memory, MAX_MEMORY);
+    fclose(f);
+
+    if (size < 0) {
+        printf("Error parsing hexfile\n");
+        free(memory);
+        return 1;
+    }
+
+    memory[FLASH_END-1] = 0x55;
+
+    bundle_from_image(fw, memory, FLASH_START, FLASH_END);
+    free(memory);
+    return 0;
+}
+
+void *flash_worker(void *arg) {
+    struct flash_job *job = arg;
+    uint64_t start = monotonic_ns();
+    const char *failed;
+    mnemo *dev = mnemo_open_record(job->tty, MNEMO_VERSION_1, job->speed, job->record, &failed);
+    if (dev == NULL) {
+        job->result = flash_fail(job, failed == job->record ? "Error opening record file" : "Error opening device");
+    } else {
+        job->result = flash(dev, job);
+        job->stats = dev->io->stats;
+        job->counters = dev->counters;
+        if (!job->fleet && !job->log) {
+            print_latency(dev);
+            print_counters(&dev->counters);
+        }
+        mnemo_close(dev);
+    }
+    job->seconds = (monotonic_ns() - start) / 1e9;
+    return NULL;
+}
+
+int flash_fleet(char **ttys, int count, speed_t speed, const char *record, const fw_bundle *fw) {
+    struct flash_job *jobs = calloc(count, sizeof(struct flash_job));
+    for (int i = 0; i < count; i++) {
+        jobs[i].tty = ttys[i];
+        jobs[i].speed = speed;
+        jobs[i].fw = fw;
+        jobs[i].fleet = true;
+        if (record) {
+            // one capture per device: <file>.<tty name>
+            const char *name = strrchr(ttys[i], '/') ? strrchr(ttys[i], '/') + 1 : ttys[i];
+            jobs[i].record = malloc(strlen(record) + strlen(name) + 2);
+            sprintf(jobs[i].record, "%s.%s", record, name);
+        }
+        jobs[i].started = pthread_create(&jobs[i].thread, NULL, flash_worker, &jobs[i]) == 0;
+        if (!jobs[i].started) {
+            jobs[i].result = flash_fail(&jobs[i], "Error starting worker");
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+    }
+
+    printf("\nSummary:\n");
+    for (int i = 0; i < count; i++) {
+        struct flash_job *job = &jobs[i];
+        if (job->result == 0) {
+            struct transport_stats *s = &job->stats;
+            printf("  %-24s OK      %6.1f s, %u round trips, avg %.3f ms",
+                job->tty, job->seconds, s->round_trips,
+                s->round_trips ? s->rtt_total_ns / 1e6 / s->round_trips : 0.0);
+        } else {
+            printf("  %-24s FAILED  %6.1f s, %s", job->tty, job->seconds, job->error);
+            failed++;
+        }
+        struct bl_counters *c = &job->counters;
+        printf(", %u resyncs, %u rows rewritten\n", c->resyncs, c->rewritten_rows);
+        free(job->record);
+    }
+    printf("%d of %d devices updated\n", count - failed, count);
+    free(jobs);
+    return failed ? 1 : 0;
+}
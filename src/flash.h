@@ -0,0 +1,39 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "mnemo.h"
+#include "bundle.h"
+
+struct flash_job {
+    const char *tty;
+    char *record;
+    speed_t speed;
+    const fw_bundle *fw;
+    bool fleet; // one of several devices, log lines instead of a progress bar
+    void (*log)(void *userdata, const char *line); // replaces stdout when set
+    void *userdata;
+    BLInfo info;
+    int result;
+    const char *error;
+    double seconds;
+    struct transport_stats stats;
+    struct bl_counters counters;
+    pthread_t thread;
+    bool started; // thread is only valid when set
+};
+
+// HEX files are parsed and packed in memory, bundles are mapped as is
+int load_firmware(const char *file, fw_bundle *fw);
+// erase, write, verify and reset on an open device, 0 on success
+int flash(mnemo *dev, struct flash_job *job);
+// opens job->tty and flashes it, usable as a thread entry point
+void *flash_worker(void *arg);
+// flashes every tty concurrently from the same image, one thread per device
+int flash_fleet(char **ttys, int count, speed_t speed, const char *record, const fw_bundle *fw);
+
+void print_latency(mnemo *dev);
+void print_counters(const struct bl_counters *c);
+
+#endif
@@ -0,0 +1,119 @@
+#include "lz.h"
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, const uint8_t *lit, size_t len, uint8_t **token) {
+    *token = op++;
+    **token = (len >= 15 ? 15 : len) << 4;
+    if (len >= 15) op = put_len(op, len - 15);
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    if (cap < lz_bound(len)) return 0;
+
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint8_t *op = dst;
+    uint8_t *token;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t h = lz_hash(src + ip);
+        size_t ref = table[h];
+        table[h] = ip;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < len && src[ref + match] == src[ip + match]) match++;
+
+        op = put_literals(op, src + anchor, ip - anchor, &token);
+        size_t offset = ip - ref;
+        *op++ = offset & 0xff;
+        *op++ = (offset & 0xff00) >> 8;
+        size_t extra = match - LZ_MIN_MATCH;
+        *token |= extra >= 15 ? 15 : extra;
+        if (extra >= 15) op = put_len(op, extra - 15);
+
+        ip += match;
+        anchor = ip;
+    }
+
+    // Last sequence is literals only
+    op = put_literals(op, src + anchor, len - anchor, &token);
+    return op - dst;
+}
+
+static int get_len(const uint8_t *src, size_t len, size_t *ip, size_t *value) {
+    uint8_t b;
+    do {
+        if (*ip >= len) return -1;
+        b = src[(*ip)++];
+        *value += b;
+    } while (b == 255);
+    return 0;
+}
+
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+        uint8_t token = src[ip++];
+
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(src, len, &ip, &lit) < 0) return -1;
+        if (lit > len - ip || lit > cap - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == len) break;
+
+        if (len - ip < 2) return -1;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        size_t match = token & 0x0f;
+        if (match == 15 && get_len(src, len, &ip, &match) < 0) return -1;
+        match += LZ_MIN_MATCH;
+        if (match > cap - op) return -1;
+
+        // Byte by byte, source and destination may overlap
+        for (size_t i = 0; i < match; i++) {
+            dst[op + i] = dst[op - offset + i];
+        }
+        op += match;
+    }
+    return op;
+}
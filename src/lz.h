@@ -0,0 +1,17 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Small LZ77 block codec (LZ4-style sequences: token, literals, 16 bit offset)
+
+// worst case compressed size for len input bytes
+size_t lz_bound(size_t len);
+// compressed size, 0 if cap < lz_bound(len)
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+// decompressed size, -1 on corrupt input or if output doesn't fit in cap
+ssize_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif
@@ -1,4 +1,6 @@
 #include "mnemo.h"
+#include "record.h"
+#include <errno.h>
 
 char CMD_GETDATA [1] = {0x43};
 
@@ -19,39 +21,85 @@ char CMD_GETDATA [1] = {0x43};
 
 #define BL_AUTOBAUD 0x55
 
+#define BL_RESYNC_ATTEMPTS 5
+#define BL_QUIET_MS 50
+
+#define BL_RTO_INITIAL_MS 1000 // before the first bl_version() answer
+#define BL_RTO_MIN_MS 50
+#define BL_RTO_MAX_MS 60000
+#define BL_BACKOFF_MAX 4
+
+// Device work assumed until a kind has been measured, generous for PIC18 flash timings
+static const double bl_work_seed_ms[BL_KIND_COUNT] = {
+    [BL_KIND_VERSION] = 0,
+    [BL_KIND_READ] = 0,
+    [BL_KIND_WRITE] = 5,
+    [BL_KIND_ERASE] = 5,
+    [BL_KIND_CHECKSUM] = 0.002,
+};
+
+// Linux speed_t is a B constant, elsewhere (and when callers pass a number) it's the rate
+static uint32_t speed_bits(speed_t speed) {
+    switch (speed) {
+        case B9600: return 9600;
+        case B19200: return 19200;
+        case B38400: return 38400;
+        case B57600: return 57600;
+        case B115200: return 115200;
+        case B230400: return 230400;
+    }
+    return speed;
+}
+
 
 mnemo* mnemo_open(const char *tty, enum mnemo_version version, speed_t speed) {
-    int fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY);
-    if (fd < 0) {
+    transport *io = transport_open(tty, speed);
+    if (io == NULL) {
         return NULL;
     }
-    mnemo *device = malloc(sizeof(mnemo));
-    device->fd = fd;
-    device->oldtio = malloc(sizeof(struct termios));  
-    device->version = version;  
-    tcgetattr(device->fd, device->oldtio);
-    struct termios settings;
-    bzero(&settings, sizeof(settings));
-    settings.c_cflag = CS8 | CLOCAL | CREAD;
-    cfsetspeed(&settings, speed);
-    tcflush(device->fd, TCIFLUSH);
-    tcsetattr(device->fd, TCSANOW, &settings);
-    
-    device->pfd.fd = fd;
-    device->pfd.events = POLLIN;
-    device->pfd.revents = 0;
+    mnemo *device = mnemo_open_transport(io, version);
+    // Sockets and replays have no serial line to wait for
+    if (strcmp(io->ops->name, "tty") == 0) {
+        device->timing.baud = speed_bits(speed);
+    }
+    return device;
+}
 
+mnemo* mnemo_open_transport(transport *io, enum mnemo_version version) {
+    mnemo *device = malloc(sizeof(mnemo));
+    device->io = io;
+    device->version = version;
+    memset(device->frame, 0, sizeof(device->frame));
+    memset(&device->counters, 0, sizeof(device->counters));
+    memset(&device->timing, 0, sizeof(device->timing));
     return device;
 }
 
+mnemo *mnemo_open_record(const char *tty, enum mnemo_version version, speed_t speed, const char *record,
+    const char **failed) {
+    mnemo *dev = mnemo_open(tty, version, speed);
+    *failed = tty;
+    if (dev == NULL || record == NULL) {
+        return dev;
+    }
+    transport *io = transport_record(dev->io, record);
+    if (io == NULL) {
+        int err = errno;
+        mnemo_close(dev);
+        errno = err;
+        *failed = record;
+        return NULL;
+    }
+    dev->io = io;
+    return dev;
+}
+
 void mnemo_close(mnemo *device) {
-    tcsetattr(device->fd,TCSANOW,device->oldtio);  
-    close(device->fd);
-    free(device->oldtio);
+    transport_close(device->io);
     free(device);
 }
 
-void mnemo_getdata(mnemo *dev, void (*ondata)(char*, int, void*), void* userdata) {
+int mnemo_getdata(mnemo *dev, void (*ondata)(char*, int, void*), void* userdata) {
     if (dev->version == MNEMO_VERSION_1) {
         time_t t = time(NULL);
         struct tm *info = localtime(&t);
@@ -62,26 +110,36 @@ void mnemo_getdata(mnemo *dev, void (*ondata)(char*, int, void*), void* userdata
             (char)info->tm_hour,
             (char)info->tm_min,
         };
-        write(dev->fd, CMD_GETDATA, 1);
+        if (transport_write(dev->io, CMD_GETDATA, 1) < 0) {
+            return -1;
+        }
+        transport_drain(dev->io);
         usleep(100*1000);
-        write(dev->fd, header, 5);
+        if (transport_write(dev->io, header, 5) < 0) {
+            return -1;
+        }
     }    
     else if (dev->version == MNEMO_VERSION_2) {
-        write(dev->fd, "getdata\n", 8);
+        if (transport_write(dev->io, "getdata\n", 8) < 0) {
+            return -1;
+        }
     }
 
     int retry = 0;
 
     while (retry < 5) {
         char buf[1024];
-        int n = read(dev->fd, buf, sizeof(buf));
-        retry = (n <= 0) ? retry + 1 : 0;
+        int n = transport_read(dev->io, buf, sizeof(buf), 1, 100);
+        if (n < 0) {
+            return -1;
+        }
+        retry = (n == 0) ? retry + 1 : 0;
         if(retry > 0) {
-            usleep(100*1000);
             continue;
         }
         ondata(buf, n, userdata);
     }
+    return 0;
 }
 
 /*
@@ -98,23 +156,88 @@ void mnemo_getdata(mnemo *dev, void (*ondata)(char*, int, void*), void* userdata
 //     printf("\n");
 // }
 
-static int read_bytes(mnemo *dev, uint8_t * response, size_t count, int timeout) {
+static double rto_ms(const struct bl_rtt *r) {
+    return r->srtt_ms + 4 * r->rttvar_ms;
+}
+
+static void rtt_sample(struct bl_rtt *r, double ms) {
+    if (r->samples == 0) {
+        r->srtt_ms = ms;
+        r->rttvar_ms = ms / 2;
+    } else {
+        double err = ms - r->srtt_ms;
+        r->rttvar_ms += ((err < 0 ? -err : err) - r->rttvar_ms) / 4;
+        r->srtt_ms += err / 8;
+    }
+    r->samples++;
+}
+
+// 8N1, ten bits on the line per byte
+static double wire_ms(const mnemo *dev, size_t bytes) {
+    if (dev->timing.baud == 0) {
+        return 0;
+    }
+    return bytes * 10 * 1000.0 / dev->timing.baud;
+}
+
+int bl_timeout(const mnemo *dev, enum bl_command_kind kind, size_t bytes, uint32_t units) {
+    const struct bl_timing *t = &dev->timing;
+    const struct bl_rtt *link = &t->rtt[BL_KIND_VERSION];
+    double ms = link->samples ? rto_ms(link) : BL_RTO_INITIAL_MS;
+    if (kind != BL_KIND_VERSION) {
+        const struct bl_rtt *work = &t->rtt[kind];
+        // Seed as if it was the first sample: srtt + 4 * srtt / 2
+        ms += units * (work->samples ? rto_ms(work) : 3 * bl_work_seed_ms[kind]);
+    }
+    ms = (ms + wire_ms(dev, bytes)) * (1 << t->rtt[kind].backoff);
+    if (ms < BL_RTO_MIN_MS) ms = BL_RTO_MIN_MS;
+    if (ms > BL_RTO_MAX_MS) ms = BL_RTO_MAX_MS;
+    return (int)ms + 1;
+}
+
+// Splits a response time into wire time, link latency and device work per unit
+static void bl_measure(mnemo *dev, enum bl_command_kind kind, size_t bytes, uint32_t units) {
+    struct bl_timing *t = &dev->timing;
+    double ms = (monotonic_ns() - t->sent_ns) / 1e6 - wire_ms(dev, bytes);
+    if (kind == BL_KIND_VERSION) {
+        rtt_sample(&t->rtt[kind], ms < 0 ? 0 : ms);
+        t->rtt[kind].backoff = 0;
+        return;
+    }
+    if (units == 0) {
+        return;
+    }
+    ms -= t->rtt[BL_KIND_VERSION].srtt_ms;
+    rtt_sample(&t->rtt[kind], ms < 0 ? 0 : ms / units);
+    t->rtt[kind].backoff = 0;
+}
+
+// Reads a response of count bytes to a command that sent sent bytes
+static int read_bytes(mnemo *dev, uint8_t * response, size_t count,
+    enum bl_command_kind kind, size_t sent, uint32_t units) {
     if (dev == NULL) {
         return -2;
     }
-    size_t bytes_read = 0;
-    while (bytes_read < count) {
-        int ret = poll(&dev->pfd, 1, timeout);
-        if (ret == 0) {
-            //printf("oopsie: \n");
-            //hexdump(response, bytes_read);
-            return -1;
-        }
-        int n = read(dev->fd, response+bytes_read, count - bytes_read);
-        //printf("got %d bytes\n", n);
-        bytes_read += n;
+    int timeout = bl_timeout(dev, kind, sent + count, units);
+    ssize_t n = transport_read(dev->io, response, count, count, timeout);
+    if (n < 0 || (size_t)n < count) {
+        //printf("oopsie: \n");
+        //hexdump(response, n);
+        dev->counters.timeouts++;
+        // Slow link or slow device, this kind gets more time until it answers in time again
+        struct bl_rtt *r = &dev->timing.rtt[kind];
+        if (r->backoff < BL_BACKOFF_MAX) r->backoff++;
+        dev->timing.pending_ms = timeout;
+        return -1;
+    }
+    // Responses start with an echo of the command, anything else means we're out of sync
+    if (count >= BL_FRAME_LEN && memcmp(response, dev->frame, BL_FRAME_LEN) != 0) {
+        dev->counters.desyncs++;
+        return -1;
     }
-    return bytes_read;
+    bl_measure(dev, kind, sent + count, units);
+    dev->timing.pending_ms = 0;
+    return n;
 }
 
 
@@ -124,7 +247,7 @@ static ssize_t bl_write_command(
     bool is_write,
     uint16_t size, 
     uint32_t addr) {
-    uint8_t x [10] = {
+    uint8_t x [BL_FRAME_LEN] = {
         BL_AUTOBAUD, 
         cmd, 
         (size & 0xff), 
@@ -136,17 +259,19 @@ static ssize_t bl_write_command(
         (addr & 0xff0000) >> 16,
         0x00
     };
-    return write(dev->fd, x, sizeof(x));
+    memcpy(dev->frame, x, sizeof(x));
+    dev->timing.sent_ns = monotonic_ns();
+    return transport_write(dev->io, x, sizeof(x));
 }
 
 
 int bl_version(mnemo *dev, BLInfo *info) {
-    size_t size = bl_write_command(dev, BL_CMD_GETVER, false, 0x00, 0x00);
+    ssize_t size = bl_write_command(dev, BL_CMD_GETVER, false, 0x00, 0x00);
     if (size <= 0) {
         return -2;
     }
     uint8_t response [100];
-    int n = read_bytes(dev, response, (size_t)26, 1000);
+    int n = read_bytes(dev, response, (size_t)26, BL_KIND_VERSION, size, 0);
     if (n < 0) {
         return n;
     }
@@ -164,26 +289,28 @@ int bl_version(mnemo *dev, BLInfo *info) {
 }
 
 int bl_flash_read(mnemo *dev, uint32_t addr, uint8_t * data, uint16_t len) {
-    size_t size = bl_write_command(dev, BL_CMD_FLSH_READ, false, len, addr);
+    ssize_t size = bl_write_command(dev, BL_CMD_FLSH_READ, false, len, addr);
     if (size <= 0) {
         return -2;
     }
     uint8_t response [100];
-    int n = read_bytes(dev, response, size+(size_t)len, 1000);
+    int n = read_bytes(dev, response, size+(size_t)len, BL_KIND_READ, size, 1);
     if (n < 0) {
         return n;
     }
     return 0;
 }
 
-int bl_flash_write(mnemo *dev, uint32_t addr, uint8_t * data, uint16_t len) {
-    size_t size = bl_write_command(dev, BL_CMD_FLSH_WRITE, true, len, addr);
+int bl_flash_write(mnemo *dev, uint32_t addr, const uint8_t * data, uint16_t len) {
+    ssize_t size = bl_write_command(dev, BL_CMD_FLSH_WRITE, true, len, addr);
     if (size <= 0) {
         return -2;
     }
-    write(dev->fd, data, len);
+    if (transport_write(dev->io, data, len) < 0) {
+        return -2;
+    }
     uint8_t response [100];
-    int n = read_bytes(dev, response, size+1, 1000);
+    int n = read_bytes(dev, response, size+1, BL_KIND_WRITE, size+len, 1);
     if (n < 0) {
         return n;
     }
@@ -195,12 +322,12 @@ int bl_flash_write(mnemo *dev, uint32_t addr, uint8_t * data, uint16_t len) {
 
 
 int bl_flash_erase(mnemo *dev, uint32_t addr, uint16_t len) {
-    size_t size = bl_write_command(dev, BL_CMD_FLSH_ERASE, true, len, addr);
+    ssize_t size = bl_write_command(dev, BL_CMD_FLSH_ERASE, true, len, addr);
     if (size <= 0) {
         return -2;
     }
     uint8_t response [100];
-    int n = read_bytes(dev, response, size+1, 5000);
+    int n = read_bytes(dev, response, size+1, BL_KIND_ERASE, size, len);
     if (n < 0) {
         return n;
     }
@@ -211,12 +338,12 @@ int bl_flash_erase(mnemo *dev, uint32_t addr, uint16_t len) {
 }
 
 int bl_checksum(mnemo *dev, uint32_t addr, uint16_t len) {
-    size_t size = bl_write_command(dev, BL_CMD_CHKSUM, false, len, addr);
+    ssize_t size = bl_write_command(dev, BL_CMD_CHKSUM, false, len, addr);
     if (size <= 0) {
         return -2;
     }
     uint8_t response [100];
-    int n = read_bytes(dev, response, size+2, 1000);
+    int n = read_bytes(dev, response, size+2, BL_KIND_CHECKSUM, size, len);
     if (n < 0) {
         return n;
     }
@@ -225,14 +352,36 @@ int bl_checksum(mnemo *dev, uint32_t addr, uint16_t len) {
 }
 
 int bl_reset(mnemo *dev) {
-    size_t size = bl_write_command(dev, BL_CMD_RESET, false, 0, 0);    
+    ssize_t size = bl_write_command(dev, BL_CMD_RESET, false, 0, 0);    
     if (size <= 0) {
         return -2;
     }
+    transport_drain(dev->io);
     // Doesnt seem to respond before rebooting
     return 0;
 }
 
+int bl_resync(mnemo *dev) {
+    BLInfo info;
+    // A command that timed out may still be running (a slow erase), give it its budget
+    // once more so its late answer doesn't collide with the version queries
+    if (dev->timing.pending_ms > 0) {
+        uint8_t b;
+        dev->io->write_ns = 0;
+        transport_read(dev->io, &b, 1, 1, dev->timing.pending_ms);
+        dev->timing.pending_ms = 0;
+    }
+    for (int i = 0; i < BL_RESYNC_ATTEMPTS; i++) {
+        dev->counters.resyncs++;
+        // Let a half received command run out on the device, then drop whatever it sent
+        transport_discard(dev->io, BL_QUIET_MS);
+        if (bl_version(dev, &info) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
 uint16_t bl_calc_cksum(const uint8_t *data, size_t len) {
     uint8_t a = 0, b = 0;
 
@@ -9,6 +9,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include "transport.h"
 
 enum mnemo_version
 {
@@ -16,16 +17,68 @@ enum mnemo_version
     MNEMO_VERSION_2
 };
 
+#define BL_FRAME_LEN 10
+
+struct bl_counters {
+    uint32_t timeouts;       // responses that didn't arrive in time
+    uint32_t desyncs;        // responses not echoing the command
+    uint32_t resyncs;        // bl_resync() attempts
+    uint32_t rewritten_rows; // rows written again after a failure
+};
+
+enum bl_command_kind {
+    BL_KIND_VERSION,  // link latency, no device work
+    BL_KIND_READ,
+    BL_KIND_WRITE,
+    BL_KIND_ERASE,    // per erased row
+    BL_KIND_CHECKSUM, // per checksummed byte
+    BL_KIND_COUNT
+};
+
+// TCP style smoothed round trip estimate (RFC 6298)
+struct bl_rtt {
+    uint32_t samples;
+    double srtt_ms;
+    double rttvar_ms;
+    int backoff; // doublings since the last timeout, kept until the next valid sample
+};
+
+/*
+    Bootloader response time model, timeouts follow the observed device
+    instead of fixed values.
+
+    response = wire time at baud + link latency + units * device work
+
+    Link latency is learned from bl_version() round trips, device work per
+    unit (row for erase, byte for checksum, command otherwise) per command
+    kind. Each part times out after srtt + 4 * rttvar. A timeout doubles
+    the budget of its kind until that kind is measured again (Karn).
+*/
+struct bl_timing {
+    uint32_t baud;   // bits per second, 0 if unknown (no wire time)
+    struct bl_rtt rtt[BL_KIND_COUNT]; // link latency for BL_KIND_VERSION, work per unit otherwise
+    uint64_t sent_ns; // when the pending command was written
+    int pending_ms;   // budget of a command that timed out and may still be running
+};
+
 typedef struct {
-    int fd;
-    struct termios * oldtio;
+    transport *io;
     enum mnemo_version version;
-    struct pollfd pfd;
+    uint8_t frame[BL_FRAME_LEN]; // last bootloader command sent
+    struct bl_counters counters;
+    struct bl_timing timing;
 } mnemo;
 
 mnemo *mnemo_open(const char *tty, enum mnemo_version version, speed_t speed);
+// same as mnemo_open, capturing the session to record when not NULL,
+// on failure *failed is tty or record, whichever couldn't be opened (errno is set)
+mnemo *mnemo_open_record(const char *tty, enum mnemo_version version, speed_t speed, const char *record,
+    const char **failed);
+// takes ownership of io
+mnemo *mnemo_open_transport(transport *io, enum mnemo_version version);
 void mnemo_close(mnemo *device);
-void mnemo_getdata(mnemo *dev, void (*ondata)(char*, int, void*), void* userdata);
+// -1 if reading failed (e.g. the device went away), 0 once it went quiet
+int mnemo_getdata(mnemo *dev, void (*ondata)(char*, int, void*), void* userdata);
 
 //bootloader
 typedef struct {
@@ -39,9 +92,13 @@ typedef struct {
 
 int bl_version(mnemo *dev, BLInfo *info);
 int bl_flash_read(mnemo *dev, uint32_t addr, uint8_t * data, uint16_t len);
-int bl_flash_write(mnemo *dev, uint32_t addr, uint8_t * data, uint16_t len);
+int bl_flash_write(mnemo *dev, uint32_t addr, const uint8_t * data, uint16_t len);
 int bl_flash_erase(mnemo *dev, uint32_t addr, uint16_t len);
 int bl_checksum(mnemo *dev, uint32_t addr, uint16_t len);
 int bl_reset(mnemo *dev);
+// flushes input and retries bl_version() until the bootloader answers in sync
+int bl_resync(mnemo *dev);
 uint16_t bl_calc_cksum(const uint8_t *data, size_t len);
+// timeout in ms for a command of kind moving bytes over the wire, units as in bl_timing
+int bl_timeout(const mnemo *dev, enum bl_command_kind kind, size_t bytes, uint32_t units);
 #endif
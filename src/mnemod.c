@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "mnemo.h"
+#include "autodetect.h"
+#include "flash.h"
+
+/*
+    mnemod: keeps devices open and shares them between local clients
+
+    Line based requests on a unix socket, several per connection:
+
+    list                         device lines, then "ok"
+    rescan                       re-enumerates devices, "ok <count>"
+    status <tty>                 one device line, then "ok"
+    import <tty> [v2]            "data <n>\n" + n raw bytes per chunk, then "ok <total>"
+    update <tty> <file> [<baud>] "log <text>" lines, then "ok" or "error <reason>"
+
+    device line: "device <tty> <state> open|closed [bootloader <ver> id <id> row <size>]"
+    Requests for a busy device wait for it ("queued" is sent first). Only
+    autodetected ttys and the ones given on the command line are served.
+*/
+
+#define PROGRAM_VERSION "0.1"
+#define DEFAULT_SOCKET "/tmp/mnemod.sock"
+#define DEFAULT_BAUD 460800
+#define MAX_REQUEST 1024
+
+struct device {
+    char *tty;
+    pthread_mutex_t lock; // held for the whole request using the device
+    mnemo *dev;           // kept open between requests, owned by the lock holder
+    speed_t speed;
+    enum mnemo_version version;
+    const char *state;    // guarded by table_lock
+    bool open;            // dev != NULL as of the last set_state(), guarded by table_lock
+    bool has_info;
+    BLInfo info;          // cached from the last bootloader query
+};
+
+static struct device devices[AUTODETECT_MAX];
+static int device_count = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int default_baud = DEFAULT_BAUD;
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_line(int fd, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0) return -1;
+    if (n > (int)sizeof(line) - 2) n = sizeof(line) - 2;
+    line[n++] = '\n';
+    return send_all(fd, line, n);
+}
+
+// Device table
+
+static struct device *add_device(const char *tty) {
+    if (device_count == AUTODETECT_MAX) {
+        return NULL;
+    }
+    struct device *d = &devices[device_count++];
+    d->tty = strdup(tty);
+    pthread_mutex_init(&d->lock, NULL);
+    d->dev = NULL;
+    d->state = "idle";
+    d->open = false;
+    d->has_info = false;
+    return d;
+}
+
+// Known devices stay in the table (and open) so clients holding them aren't disturbed
+static int rescan(void) {
+    char *paths[AUTODETECT_MAX];
+    int count = autodetect_all(paths, AUTODETECT_MAX);
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < count; i++) {
+        bool known = false;
+        for (int j = 0; j < device_count; j++) {
+            if (strcmp(devices[j].tty, paths[i]) == 0) known = true;
+        }
+        if (!known) add_device(paths[i]);
+        free(paths[i]);
+    }
+    int total = device_count;
+    pthread_mutex_unlock(&table_lock);
+    return total;
+}
+
+// Clients can only name devices already in the table, never open arbitrary paths
+static struct device *find_device(const char *tty) {
+    struct device *d = NULL;
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i].tty, tty) == 0) d = &devices[i];
+    }
+    pthread_mutex_unlock(&table_lock);
+    return d;
+}
+
+// Called by the holder of d->lock, so reading d->dev here is safe
+static void set_state(struct device *d, const char *state) {
+    pthread_mutex_lock(&table_lock);
+    d->state = state;
+    d->open = d->dev != NULL;
+    pthread_mutex_unlock(&table_lock);
+}
+
+static void send_device(int fd, struct device *d) {
+    pthread_mutex_lock(&table_lock);
+    const char *state = d->state;
+    const char *open = d->open ? "open" : "closed";
+    bool has_info = d->has_info;
+    BLInfo info = d->info;
+    pthread_mutex_unlock(&table_lock);
+    if (has_info) {
+        send_line(fd, "device %s %s %s bootloader %x id %x row %u",
+            d->tty, state, open, info.bl_version, info.device_id, info.erase_row_size);
+    } else {
+        send_line(fd, "device %s %s %s", d->tty, state, open);
+    }
+}
+
+// Locks the device for a request, reopening it when the line settings differ
+static mnemo *acquire(int fd, struct device *d, speed_t speed, enum mnemo_version version, const char *state) {
+    if (pthread_mutex_trylock(&d->lock) != 0) {
+        send_line(fd, "queued");
+        pthread_mutex_lock(&d->lock);
+    }
+    if (d->dev && d->speed != speed) {
+        mnemo_close(d->dev);
+        d->dev = NULL;
+    }
+    if (!d->dev) {
+        d->dev = mnemo_open(d->tty, version, speed);
+        d->speed = speed;
+    }
+    if (!d->dev) {
+        int err = errno;
+        set_state(d, "idle");
+        pthread_mutex_unlock(&d->lock);
+        errno = err;
+        return NULL;
+    }
+    d->dev->version = version;
+    set_state(d, state);
+    return d->dev;
+}
+
+// Closes the device after a failure so the next request starts from a clean open
+static void release(struct device *d, bool failed) {
+    if (failed && d->dev) {
+        mnemo_close(d->dev);
+        d->dev = NULL;
+    }
+    set_state(d, "idle");
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Requests
+
+struct client {
+    int fd;
+    size_t sent;
+    bool broken;
+};
+
+static void on_import_data(char *buf, int n, void *userdata) {
+    struct client *c = userdata;
+    if (c->broken) return;
+    if (send_line(c->fd, "data %d", n) < 0 || send_all(c->fd, buf, n) < 0) {
+        c->broken = true;
+        return;
+    }
+    c->sent += n;
+}
+
+static void cmd_import(int fd, struct device *d, bool v2) {
+    mnemo *dev = acquire(fd, d, B9600, v2 ? MNEMO_VERSION_2 : MNEMO_VERSION_1, "import");
+    if (!dev) {
+        send_line(fd, "error cannot open %s: %s", d->tty, strerror(errno));
+        return;
+    }
+    struct client c = { fd, 0, false };
+    int result = mnemo_getdata(dev, on_import_data, &c);
+    // Nothing at all usually means a stale fd after a replug, reopen next time
+    release(d, result < 0 || c.sent == 0);
+    if (result < 0) {
+        send_line(fd, "error reading %s: %s", d->tty, strerror(errno));
+    } else {
+        send_line(fd, "ok %zu", c.sent);
+    }
+}
+
+static void on_update_log(void *userdata, const char *line) {
+    struct client *c = userdata;
+    size_t len = strlen(line);
+    while (len > 0 && line[len - 1] == '\n') len--;
+    if (!c->broken && send_line(c->fd, "log %.*s", (int)len, line) < 0) {
+        c->broken = true;
+    }
+}
+
+static void cmd_update(int fd, struct device *d, const char *file, int baud) {
+    fw_bundle fw;
+    // load_firmware reports problems on our stdout, the client only gets the summary
+    if (load_firmware(file, &fw) != 0) {
+        send_line(fd, "error cannot load firmware %s", file);
+        return;
+    }
+    mnemo *dev = acquire(fd, d, baud, MNEMO_VERSION_1, "update");
+    if (!dev) {
+        send_line(fd, "error cannot open %s: %s", d->tty, strerror(errno));
+        bundle_free(&fw);
+        return;
+    }
+
+    struct client c = { fd, 0, false };
+    struct flash_job job = {
+        .tty = d->tty,
+        .speed = baud,
+        .fw = &fw,
+        .log = on_update_log,
+        .userdata = &c
+    };
+    memset(&dev->counters, 0, sizeof(dev->counters));
+    int result = flash(dev, &job);
+    if (job.info.bl_version || job.info.erase_row_size) {
+        pthread_mutex_lock(&table_lock);
+        d->info = job.info;
+        d->has_info = true;
+        pthread_mutex_unlock(&table_lock);
+    }
+    struct bl_counters *k = &dev->counters;
+    send_line(fd, "log Retries: %u timeouts, %u out of sync, %u resyncs, %u rows rewritten",
+        k->timeouts, k->desyncs, k->resyncs, k->rewritten_rows);
+    // The device reboots into the application after a successful update
+    release(d, true);
+    bundle_free(&fw);
+
+    if (result == 0) {
+        send_line(fd, "ok");
+    } else {
+        send_line(fd, "error %s", job.error ? job.error : "update failed");
+    }
+}
+
+static void handle_request(int fd, char *line) {
+    char *argv[4] = { 0 };
+    int argc = 0;
+    char *save;
+    for (char *tok = strtok_r(line, " \t\r", &save); tok && argc < 4; tok = strtok_r(NULL, " \t\r", &save)) {
+        argv[argc++] = tok;
+    }
+    if (argc == 0) return;
+
+    if (strcmp(argv[0], "list") == 0) {
+        pthread_mutex_lock(&table_lock);
+        int count = device_count;
+        pthread_mutex_unlock(&table_lock);
+        for (int i = 0; i < count; i++) {
+            send_device(fd, &devices[i]);
+        }
+        send_line(fd, "ok");
+    } else if (strcmp(argv[0], "rescan") == 0) {
+        send_line(fd, "ok %d", rescan());
+    } else if (strcmp(argv[0], "status") == 0 && argc == 2) {
+        struct device *d = find_device(argv[1]);
+        if (!d) {
+            send_line(fd, "error unknown device");
+            return;
+        }
+        send_device(fd, d);
+        send_line(fd, "ok");
+    } else if (strcmp(argv[0], "import") == 0 && (argc == 2 || argc == 3)) {
+        struct device *d = find_device(argv[1]);
+        if (!d) {
+            send_line(fd, "error unknown device");
+            return;
+        }
+        cmd_import(fd, d, argc == 3 && strcmp(argv[2], "v2") == 0);
+    } else if (strcmp(argv[0], "update") == 0 && (argc == 3 || argc == 4)) {
+        struct device *d = find_device(argv[1]);
+        int baud = argc == 4 ? atoi(argv[3]) : default_baud;
+        if (!d || baud <= 0) {
+            send_line(fd, "error %s", d ? "invalid baud rate" : "unknown device");
+            return;
+        }
+        cmd_update(fd, d, argv[2], baud);
+    } else {
+        send_line(fd, "error unknown request");
+    }
+}
+
+static void *client_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[MAX_REQUEST];
+    size_t len = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - len - 1);
+        if (n <= 0) break;
+        len += n;
+        char *nl;
+        while ((nl = memchr(buf, '\n', len)) != NULL) {
+            *nl = '\0';
+            handle_request(fd, buf);
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len);
+        }
+        if (len == sizeof(buf) - 1) {
+            send_line(fd, "error request too long");
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s [--socket <path>] [--baud <rate>] [<tty>...]\n"
+        "\n"
+        "Description:\n"
+        "  Keep Mnemo devices open and serve import/update/status requests\n"
+        "  from local clients over a unix socket. Devices are autodetected,\n"
+        "  ttys given on the command line (e.g. unix:<path>) are added to\n"
+        "  them, clients can't name others. The socket is only accessible\n"
+        "  to the user running mnemod.\n"
+        "\n"
+        "Options:\n"
+        "  --socket <path>    Socket to listen on (default: " DEFAULT_SOCKET ")\n"
+        "  --baud <rate>      Default update baud rate (default: 460800)\n",
+        progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = DEFAULT_SOCKET;
+
+    struct option longopts[] = {
+        {"socket",  required_argument, 0, 's'},
+        {"baud",    required_argument, 0, 'b'},
+        {"version", no_argument,       0, 'V'},
+        {"help",    no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:b:Vh", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+            case 'b':
+                default_baud = atoi(optarg);
+                if (default_baud <= 0) {
+                    fprintf(stderr, "Invalid baud rate: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'V':
+                printf("mnemod %s\n", PROGRAM_VERSION);
+                return 0;
+            case 'h':
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // Clients that hang up mid stream shouldn't take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = optind; i < argc; i++) {
+        if (!find_device(argv[i]) && !add_device(argv[i])) {
+            fprintf(stderr, "Too many devices, ignoring %s\n", argv[i]);
+        }
+    }
+    printf("Devices: %d\n", rescan());
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    // Owner only from the start, not just after the chmod
+    mode_t old_umask = umask(0077);
+    int bound = bind(srv, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound < 0 || chmod(path, 0600) < 0 || listen(srv, 16) < 0) {
+        perror(path);
+        return 1;
+    }
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(srv, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_thread, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(srv);
+    unlink(path);
+    return 1;
+}
@@ -1,15 +1,19 @@
 #include "mnemo.h"
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include "hexfile.h"
 #include "autodetect.h"
+#include "store.h"
+#include "record.h"
+#include "dump.h"
+#include "bundle.h"
+#include "flash.h"
 
 #define PROGRAM_VERSION "0.1"
 
-enum import_format { DMP, RAW };
-
 struct import_ctx {
     int fd;
     enum import_format format;
@@ -21,20 +25,19 @@ void ondata(char *buf, int n, void *userdata){
     struct import_ctx * ctx = userdata;
     ctx->imported_bytes += n;
     printf("\r\033[KRead: %d bytes", n);
-    for (int i = 0; i < n; i++) {
-        if(ctx->format == RAW) {
-            dprintf(ctx->fd, "%c", buf[i]);
-        }
-        else {
-            dprintf(ctx->fd, "%d;", buf[i]);
-        }
-    }
+    write_dump(ctx->fd, ctx->format, buf, n);
+}
+
+void ondata_buffer(char *buf, int n, void *userdata){
+    struct dump_buffer * dump = userdata;
+    printf("\r\033[KRead: %d bytes", n);
+    dump_append(dump, (uint8_t *)buf, n);
 }
 
 void usage_import(const char *progname) {
     fprintf(stderr,
         "Usage:\n"
-        "  %s import [--format raw|dmp] [--v2] [<tty>] <file.dmp>\n"
+        "  %s import [--format raw|dmp] [--v2] [--record <file>] [<tty>] <file.dmp>\n"
         "\n"
         "Description:\n"
         "  Retrieve survey data from the Nemo and save it to a file.\n"
@@ -42,7 +45,8 @@ void usage_import(const char *progname) {
         "\n"
         "Options:\n"
         "  --format raw|dmp   Output format (default: dmp)\n"
-        "  --v2               Use Mnemo protocol version 2\n",
+        "  --v2               Use Mnemo protocol version 2\n"
+        "  --record <file>    Capture the serial session to file (replay:<file> as tty plays it back)\n",
         progname);
     exit(1);
 }
@@ -50,98 +54,250 @@ void usage_import(const char *progname) {
 void usage_update(const char *progname) {
     fprintf(stderr,
         "Usage:\n"
-        "  %s update [--baud <rate>] [<tty>] <file.hex>\n"
+        "  %s update [--baud <rate>] [--record <file>] [<tty>] <file.hex>\n"
+        "  %s update --all [--baud <rate>] [--record <file>] <file.hex>\n"
+        "  %s update [--baud <rate>] [--record <file>] <tty> <tty>... <file.hex>\n"
         "\n"
         "Description:\n"
         "  Upload a firmware update to the Nemo using the specified\n"
-        "  Intel HEX (.hex) file. If no TTY is specified, the tool attempts to\n"
-        "  autodetect it.\n"
+        "  Intel HEX (.hex) file or bundle made by pack (.mfw). If no TTY is\n"
+        "  specified, the tool attempts to autodetect it.\n"
         "\n"
         "Options:\n"
-        "  --baud <rate>      Serial baud rate (default: 460800)\n",
+        "  --all              Update every connected device in parallel\n"
+        "                     (several ttys are updated in parallel too)\n"
+        "  --baud <rate>      Serial baud rate (default: 460800)\n"
+        "  --record <file>    Capture the serial session to file (replay:<file> as tty plays it back)\n",
+        progname, progname, progname);
+    exit(1);
+}
+
+void usage_pack(const char *progname) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s pack <file.hex> <file.mfw>\n"
+        "\n"
+        "Description:\n"
+        "  Precompile an Intel HEX file into a firmware bundle: row aligned\n"
+        "  write blocks (blank rows left out) with precomputed checksums.\n"
+        "  update accepts the bundle in place of the HEX file and maps it\n"
+        "  directly, no HEX parsing. The image is checked against its\n"
+        "  checksums before anything is erased.\n",
         progname);
     exit(1);
 }
 
+void usage_store(const char *progname) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s store import [--v2] [--record <file>] [<tty>] <store>\n"
+        "  %s store add [--format raw|dmp] <store> <file.dmp>\n"
+        "  %s store export [--format raw|dmp] <store> <id> <file.dmp>\n"
+        "\n"
+        "Description:\n"
+        "  Keep imports in a deduplicating store. Every survey is stored\n"
+        "  once (compressed), each import is a manifest that rebuilds the\n"
+        "  original dump. import reads from the Nemo, add reads a dump file.\n"
+        "  Both print the id to use with export.\n"
+        "\n"
+        "Options:\n"
+        "  --format raw|dmp   Dump file format (default: dmp)\n"
+        "  --v2               Use Mnemo protocol version 2\n"
+        "  --record <file>    Capture the serial session to file (replay:<file> as tty plays it back)\n",
+        progname, progname, progname);
+    exit(1);
+}
+
 void usage(const char *progname) {
     fprintf(stderr,
         "Usage:\n"
-        "  %s import [--format raw|dmp] [--v2] [<tty>] <file.dmp>\n"
+        "  %s import [--format raw|dmp] [--v2] [--record <file>] [<tty>] <file.dmp>\n"
         "      Import surveys from Mnemo and store it to file\n"
         "\n"
-        "  %s update [--baud <rate>] [<tty>] <file.hex>\n"
-        "      Upload firmware to Mnemo from Intel HEX file\n"
+        "  %s update [--baud <rate>] [--record <file>] [<tty>] <file.hex>\n"
+        "  %s update --all [--baud <rate>] [--record <file>] <file.hex>\n"
+        "  %s update [--baud <rate>] [--record <file>] <tty> <tty>... <file.hex>\n"
+        "      Upload firmware to Mnemo from Intel HEX file or bundle,\n"
+        "      several devices are updated in parallel\n"
+        "\n"
+        "  %s pack <file.hex> <file.mfw>\n"
+        "      Precompile a HEX file into a firmware bundle for update\n"
+        "\n"
+        "  %s store import|add|export ...\n"
+        "      Keep imports in a deduplicating survey store\n"
         "\n"
         "  %s --version\n"
         "      Show version information\n"
         "\n"
         "  %s --help\n"
         "      Show this help message\n",
-        progname, progname, progname, progname);
+        progname, progname, progname, progname, progname, progname, progname, progname);
     exit(1);
 }
 
 
-static int flash(mnemo *dev, uint8_t * memory) {
-    printf("Querying bootloader\n");
-    BLInfo info;
-    int result = bl_version(dev, &info);
+static void print_store_result(int result, const char *id, struct store_stats *stats) {
+    if (result == -1) {
+        perror("Store");
+        return;
+    }
     if (result < 0) {
-        printf("Error getting bootloader version\n");
-        mnemo_close(dev);
-        return 1;
+        printf("Store is corrupt (hash mismatch or damaged object)\n");
+        return;
     }
+    printf("Stored %s: %zu bytes, %zu surveys (%zu new), %zu bytes written\n",
+        id, stats->bytes_in, stats->records, stats->new_records, stats->bytes_stored);
+}
 
-    printf("Bootloader version: %x\n", info.bl_version);
-
-    size_t start = 0x800;
-    size_t end = 0x20000;
-    size_t total = end - start;
-    size_t erase_rows =  total / info.erase_row_size;
+static int cmd_store(const char *progname, int argc, char *argv[]) {
+    if (argc < 2) {
+        usage_store(progname);
+    }
+    const char *subcmd = argv[1];
+    argc--;
+    argv++;
 
-    printf("Erasing: (%ld rows of size %d)\n", erase_rows, info.erase_row_size);
-    result = bl_flash_erase(dev, start, erase_rows);
-    if (result < 0) {
-        printf("Error erasing\n");
-        return 1;
+    enum import_format format = DMP;
+    bool version2 = false;
+    const char *record = NULL;
+
+    struct option longopts[] = {
+        {"format", required_argument, 0, 'f'},
+        {"v2",     no_argument,       0, 'v'},
+        {"record", required_argument, 0, 'r'},
+        {"help",   no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:vr:h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "raw") == 0) {
+                    format = RAW;
+                }
+                else if (strcmp(optarg, "dmp") == 0) {
+                    format = DMP;
+                } else {
+                    fprintf(stderr, "Unknown format: %s\n", optarg);
+                    usage_store(progname);
+                }
+                break;
+            case 'v':
+                version2 = true;
+                break;
+            case 'r':
+                record = optarg;
+                break;
+            case 'h':
+            default:
+                usage_store(progname);
+        }
     }
 
-    memory[end-1] = 0x55;
+    char id[STORE_ID_LEN];
+    struct store_stats stats;
+    struct dump_buffer dump = { NULL, 0, 0 };
+    int result;
 
-    for(size_t i = start; i < end; i += 0x80) {
-        float percent = 100.0f * (i - start) / total;
-        printf("\r\033[KWriting: 0x%.6zx (%.1f%%)", i, percent);
-        fflush(stdout);
-        result = bl_flash_write(dev, i, memory+i, 0x80);
-        if (result < 0) {
-            printf("\nError writing!\n");
+    if (strcmp(subcmd, "import") == 0) {
+        char *autodetected = NULL;
+        const char *tty = NULL;
+        const char *root = NULL;
+        if (optind + 1 == argc) {
+            root = argv[optind];
+            autodetected = autodetect();
+            if (!autodetected) {
+                fprintf(stderr, "No TTY specified and autodetect failed\n");
+                return 1;
+            }
+            tty = autodetected;
+        } else if (optind + 2 == argc) {
+            tty = argv[optind];
+            root = argv[optind + 1];
+        } else {
+            usage_store(progname);
+        }
+
+        const char *failed;
+        mnemo *m = mnemo_open_record(tty, version2 ? MNEMO_VERSION_2 : MNEMO_VERSION_1, B9600, record, &failed);
+        if(m == NULL) {
+            perror(failed);
+            free(autodetected);
             return 1;
         }
-    }
-    printf("\n");
 
-    printf("Verifying: ");
-    for(size_t i = start; i < end-2; i += 0xFFF0) {
-        uint16_t s = i + 0xFFF0 >= end-2 ? end-i-2 : 0xFFF0;
-        result = bl_checksum(dev, i, s);
+        printf("Reading");
+        int loaded = mnemo_getdata(m, ondata_buffer, (void*) &dump);
+        int err = errno;
+        printf("\n");
+        mnemo_close(m);
+        if (loaded < 0 || dump.len == 0) {
+            if (loaded < 0) {
+                errno = err;
+                perror(tty);
+            } else {
+                printf("No data received, nothing stored\n");
+            }
+            free(autodetected);
+            free(dump.data);
+            return 1;
+        }
+        free(autodetected);
+
+        result = store_add(root, dump.data, dump.len, id, &stats);
+        print_store_result(result, id, &stats);
+    } else if (strcmp(subcmd, "add") == 0) {
+        if (optind + 2 != argc) {
+            usage_store(progname);
+        }
+        FILE *in = fopen(argv[optind + 1], "rb");
+        int loaded = read_dump(in, format, &dump);
+        if (loaded == -1) {
+            perror(argv[optind + 1]);
+        } else if (loaded < 0) {
+            printf("%s: not a valid %s dump\n", argv[optind + 1], format == RAW ? "raw" : "dmp");
+        } else if (dump.len == 0) {
+            printf("%s: empty dump, nothing stored\n", argv[optind + 1]);
+            loaded = -2;
+        }
+        if (in) fclose(in);
+        if (loaded < 0) {
+            free(dump.data);
+            return 1;
+        }
+        result = store_add(argv[optind], dump.data, dump.len, id, &stats);
+        print_store_result(result, id, &stats);
+    } else if (strcmp(subcmd, "export") == 0) {
+        if (optind + 3 != argc) {
+            usage_store(progname);
+        }
+        const char *file = argv[optind + 2];
+        result = store_export(argv[optind], argv[optind + 1], &dump.data, &dump.len);
+        if (result == -1) {
+            perror(argv[optind + 1]);
+            return 1;
+        }
         if (result < 0) {
-            printf("Read error\n");
+            printf("Store is corrupt (hash mismatch or damaged object)\n");
             return 1;
         }
-        if (result != bl_calc_cksum(memory+i, s)) {
-            printf("Mismatch!\n");
-            return 1;           
+        int out = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        if(out < 0) {
+            perror(file);
+            free(dump.data);
+            return 1;
         }
+        write_dump(out, format, (char *)dump.data, dump.len);
+        close(out);
+        printf("Exported %s: %zu bytes\n", argv[optind + 1], dump.len);
+    } else {
+        fprintf(stderr, "Unknown store command: %s\n", subcmd);
+        usage_store(progname);
     }
-    printf("Success\n");
 
-    printf("Restarting\n");
-    result = bl_reset(dev);
-    if (result < 0) {
-        printf("Error restarting device\n");
-        return 1;
-    }
-    return 0;
+    free(dump.data);
+    return result < 0 ? 1 : 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -173,16 +329,18 @@ int main(int argc, char *argv[]) {
     if (strcmp(cmd, "import") == 0) {
         enum import_format format = DMP;
         bool version2 = false;
+        const char *record = NULL;
 
         struct option longopts[] = {
             {"format", required_argument, 0, 'f'},
             {"v2",     no_argument,       0, 'v'},
+            {"record", required_argument, 0, 'r'},
             {"help",   no_argument,       0, 'h'},
             {0, 0, 0, 0}
         };
 
         int opt;
-        while ((opt = getopt_long(argc, argv, "f:vh", longopts, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "f:vr:h", longopts, NULL)) != -1) {
             switch (opt) {
                 case 'f':
                     if (strcmp(optarg, "raw") == 0) {
@@ -198,6 +356,9 @@ int main(int argc, char *argv[]) {
                 case 'v':
                     version2 = true;
                     break;
+                case 'r':
+                    record = optarg;
+                    break;
                 case 'h':
                 default:
                     usage_import(progname);
@@ -207,7 +368,7 @@ int main(int argc, char *argv[]) {
         if (optind + 1 == argc) {
             file = argv[optind];
             autodetected = autodetect();
-            if (!tty) {
+            if (!autodetected) {
                 fprintf(stderr, "No TTY specified and autodetect failed\n");
                 return 1;
             }
@@ -225,10 +386,11 @@ int main(int argc, char *argv[]) {
             return -1;
         }
 
-        mnemo *m = mnemo_open(tty, version2 ? MNEMO_VERSION_2 : MNEMO_VERSION_1, B9600);
-        free(autodetected);
+        const char *failed;
+        mnemo *m = mnemo_open_record(tty, version2 ? MNEMO_VERSION_2 : MNEMO_VERSION_1, B9600, record, &failed);
         if(m == NULL) {
-            perror(tty);
+            perror(failed);
+            free(autodetected);
             return -1;
         }
 
@@ -240,22 +402,41 @@ int main(int argc, char *argv[]) {
             .imported_bytes = 0
         };
 
-        mnemo_getdata(m, ondata, (void*) &ctx);
+        int loaded = mnemo_getdata(m, ondata, (void*) &ctx);
+        int err = errno;
         printf("\n");
         mnemo_close(m);
         close(out);
+        // The dump is truncated, e.g. the device was unplugged mid transfer
+        if (loaded < 0) {
+            errno = err;
+            perror(tty);
+            free(autodetected);
+            return 1;
+        }
+        free(autodetected);
     } else if (strcmp(cmd, "update") == 0) {
         int baud_rate = 460800;
+        bool all = false;
+        const char *record = NULL;
 
         struct option longopts[] = {
             {"baud", required_argument, 0, 'b'},
+            {"all",  no_argument,       0, 'a'},
+            {"record", required_argument, 0, 'r'},
             {"help", no_argument,       0, 'h'},
             {0, 0, 0, 0}
         };
 
         int opt;
-        while ((opt = getopt_long(argc, argv, "b:h", longopts, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "b:ar:h", longopts, NULL)) != -1) {
             switch (opt) {
+                case 'r':
+                    record = optarg;
+                    break;
+                case 'a':
+                    all = true;
+                    break;
                 case 'b':
                     baud_rate = atoi(optarg);
                     if (baud_rate <= 0) {
@@ -269,10 +450,22 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        if (optind + 1 == argc) {
+        char *ttys[AUTODETECT_MAX];
+        int count = 0;
+        if (all) {
+            if (optind + 1 != argc) {
+                usage_update(progname);
+            }
+            file = argv[optind];
+            count = autodetect_all(ttys, AUTODETECT_MAX);
+            if (count == 0) {
+                fprintf(stderr, "No devices found\n");
+                return 1;
+            }
+        } else if (optind + 1 == argc) {
             file = argv[optind];
             autodetected = autodetect();
-            if (!tty) {
+            if (!autodetected) {
                 fprintf(stderr, "No TTY specified and autodetect failed\n");
                 return 1;
             }
@@ -280,49 +473,74 @@ int main(int argc, char *argv[]) {
         } else if (optind + 2 == argc) {
             tty = argv[optind];
             file = argv[optind + 1];
+        } else if (optind + 2 < argc && argc - optind - 1 <= AUTODETECT_MAX) {
+            // several ttys given, same as --all on just those
+            all = true;
+            for (int i = optind; i < argc - 1; i++) {
+                ttys[count++] = strdup(argv[i]);
+            }
+            file = argv[argc - 1];
         } else {
             usage_update(progname);
         }
 
-        FILE *fw = fopen(file, "r");
-        if (!fw) {
+        if (access(file, R_OK) != 0) {
             perror("Failed to open firmware file");
             return 1;
         }
         
-        if (access(tty, F_OK) != 0) {
+        if (!all && strchr(tty, ':') == NULL && access(tty, F_OK) != 0) {
             perror("TTY device not found");
             return 1;
         }
 
-        #define MAX_MEMORY (1024 * 1024)  // 1 MB buffer
-        uint8_t * memory = malloc(MAX_MEMORY);
-        memset(memory, 0xff, MAX_MEMORY);
-
-        int size = load_intel_hex(fw, memory, MAX_MEMORY);
-        fclose(fw);
-
-        if (size < 0) {
-            printf("Error parsing hexfile\n");
-            free(memory);
+        fw_bundle fw;
+        if (load_firmware(file, &fw) != 0) {
             return 1;
         }
-        
-        mnemo *dev = mnemo_open(tty, MNEMO_VERSION_1, baud_rate); // B460800
-        free(autodetected);
+        printf("Image %016llx: %u rows to write\n", (unsigned long long)fw.header->hash, fw.header->row_count);
 
         int result = 0;
-        if (dev != NULL) {
-            result = flash(dev, memory);
-        }
-        else {
-            printf("Error opening device\n");
-            result = 1;
+        if (all) {
+            printf("Updating %d devices\n", count);
+            result = flash_fleet(ttys, count, baud_rate, record, &fw);
+            for (int i = 0; i < count; i++) {
+                free(ttys[i]);
+            }
+        } else {
+            struct flash_job job = {
+                .tty = tty,
+                .record = (char *)record,
+                .speed = baud_rate,
+                .fw = &fw,
+                .fleet = false
+            };
+            flash_worker(&job);
+            result = job.result;
         }
-         
-        free(memory);
-        mnemo_close(dev);
+        free(autodetected);
+        bundle_free(&fw);
         return result;
+    } else if (strcmp(cmd, "pack") == 0) {
+        if (argc != 3) {
+            usage_pack(progname);
+        }
+        fw_bundle fw;
+        if (load_firmware(argv[1], &fw) != 0) {
+            return 1;
+        }
+        int result = bundle_write(&fw, argv[2]);
+        if (result < 0) {
+            perror(argv[2]);
+        } else {
+            printf("Packed %s: image %016llx, %u rows, %u verify windows, %zu bytes\n",
+                argv[2], (unsigned long long)fw.header->hash, fw.header->row_count,
+                fw.header->window_count, fw.len);
+        }
+        bundle_free(&fw);
+        return result < 0 ? 1 : 0;
+    } else if (strcmp(cmd, "store") == 0) {
+        return cmd_store(progname, argc, argv);
     } else {
         fprintf(stderr, "Unknown subcommand: %s\n", cmd);
         usage(argv[0]);
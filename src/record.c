@@ -0,0 +1,250 @@
+#include "record.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_MAGIC "MNREC"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_LEN 8
+
+#define EVENT_TX 0
+#define EVENT_RX 1
+
+// Recorder
+
+struct record_priv {
+    transport *inner;
+    FILE *f;
+    uint64_t last_ns;
+};
+
+static void put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc(v, f);
+}
+
+static void log_event(struct record_priv *p, uint8_t dir, const void *buf, size_t len) {
+    uint64_t now = monotonic_ns();
+    fputc(dir, p->f);
+    put_varint(p->f, (now - p->last_ns) / 1000);
+    put_varint(p->f, len);
+    fwrite(buf, 1, len, p->f);
+    p->last_ns = now;
+}
+
+static ssize_t record_write(transport *t, const void *buf, size_t len) {
+    struct record_priv *p = t->priv;
+    ssize_t n = transport_write(p->inner, buf, len);
+    if (n > 0) log_event(p, EVENT_TX, buf, n);
+    return n;
+}
+
+static ssize_t record_read(transport *t, void *buf, size_t len, size_t min, int timeout) {
+    struct record_priv *p = t->priv;
+    ssize_t n = transport_read(p->inner, buf, len, min, timeout);
+    if (n > 0) log_event(p, EVENT_RX, buf, n);
+    return n;
+}
+
+static int record_drain(transport *t) {
+    struct record_priv *p = t->priv;
+    return transport_drain(p->inner);
+}
+
+static void record_close(transport *t) {
+    struct record_priv *p = t->priv;
+    transport_close(p->inner);
+    fclose(p->f);
+    free(p);
+}
+
+static const struct transport_ops record_ops = {
+    .name = "record",
+    .write = record_write,
+    .read = record_read,
+    .drain = record_drain,
+    .close = record_close,
+};
+
+transport *transport_record(transport *inner, const char *file) {
+    FILE *f = fopen(file, "wb");
+    if (!f) return NULL;
+    uint8_t header[RECORD_HEADER_LEN] = { 'M', 'N', 'R', 'E', 'C', RECORD_VERSION, 0, 0 };
+    fwrite(header, 1, sizeof(header), f);
+
+    struct record_priv *p = calloc(1, sizeof(struct record_priv));
+    p->inner = inner;
+    p->f = f;
+    p->last_ns = monotonic_ns();
+
+    transport *t = calloc(1, sizeof(transport));
+    t->fd = inner->fd;
+    t->ops = &record_ops;
+    t->priv = p;
+    return t;
+}
+
+// Replay
+
+struct replay_event {
+    uint8_t dir;
+    uint64_t time_us; // since start of capture
+    const uint8_t *data;
+    size_t len;
+};
+
+struct replay_priv {
+    uint8_t *buf;
+    struct replay_event *events;
+    size_t count;
+    size_t cur;
+    size_t offset; // consumed bytes of events[cur]
+    bool realtime;
+    uint64_t sync_ns; // host time of last write
+    uint64_t sync_us; // capture time of the matching event
+    size_t mismatches;
+};
+
+static int get_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len) return -1;
+        uint8_t b = buf[(*pos)++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static struct replay_event *replay_current(struct replay_priv *p) {
+    while (p->cur < p->count && p->offset == p->events[p->cur].len) {
+        p->cur++;
+        p->offset = 0;
+    }
+    return p->cur < p->count ? &p->events[p->cur] : NULL;
+}
+
+static void sleep_until(uint64_t ns) {
+    uint64_t now = monotonic_ns();
+    if (ns > now) usleep((ns - now) / 1000);
+}
+
+static ssize_t replay_write(transport *t, const void *buf, size_t len) {
+    struct replay_priv *p = t->priv;
+    const uint8_t *data = buf;
+    size_t i = 0;
+    struct replay_event *e;
+    while (i < len && (e = replay_current(p)) != NULL && e->dir == EVENT_TX) {
+        if (p->offset == 0) {
+            p->sync_ns = monotonic_ns();
+            p->sync_us = e->time_us;
+        }
+        if (e->data[p->offset] != data[i]) p->mismatches++;
+        p->offset++;
+        i++;
+    }
+    // Writes past the capture are swallowed, the reads after them time out
+    p->mismatches += len - i;
+    return len;
+}
+
+static ssize_t replay_read(transport *t, void *buf, size_t len, size_t min, int timeout) {
+    struct replay_priv *p = t->priv;
+    size_t got = 0;
+    struct replay_event *e;
+    if (min == 0) min = 1;
+    while (got < min && (e = replay_current(p)) != NULL && e->dir == EVENT_RX) {
+        if (p->realtime && p->offset == 0) {
+            sleep_until(p->sync_ns + (e->time_us - p->sync_us) * 1000);
+        }
+        size_t n = e->len - p->offset;
+        if (n > len - got) n = len - got;
+        memcpy((uint8_t *)buf + got, e->data + p->offset, n);
+        p->offset += n;
+        got += n;
+    }
+    // The capture has no more data here, so the real device went quiet
+    if (got < min && p->realtime) {
+        usleep(timeout * 1000);
+    }
+    return got;
+}
+
+static int replay_drain(transport *t) {
+    return 0;
+}
+
+static void replay_close(transport *t) {
+    struct replay_priv *p = t->priv;
+    if (p->mismatches > 0) {
+        fprintf(stderr, "replay: %zu written bytes differ from the capture\n", p->mismatches);
+    }
+    free(p->events);
+    free(p->buf);
+    free(p);
+}
+
+static const struct transport_ops replay_ops = {
+    .name = "replay",
+    .write = replay_write,
+    .read = replay_read,
+    .drain = replay_drain,
+    .close = replay_close,
+};
+
+transport *transport_open_replay(const char *file, bool realtime) {
+    FILE *f = fopen(file, "rb");
+    if (!f) return NULL;
+
+    size_t cap = 4096, len = 0, n;
+    uint8_t *buf = malloc(cap);
+    while ((n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    fclose(f);
+
+    if (len < RECORD_HEADER_LEN || memcmp(buf, RECORD_MAGIC, 5) != 0 || buf[5] != RECORD_VERSION) {
+        free(buf);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct replay_priv *p = calloc(1, sizeof(struct replay_priv));
+    p->buf = buf;
+    p->realtime = realtime;
+    p->sync_ns = monotonic_ns();
+
+    size_t events_cap = 0;
+    size_t pos = RECORD_HEADER_LEN;
+    uint64_t time_us = 0;
+    while (pos < len) {
+        uint64_t delta, size;
+        uint8_t dir = buf[pos++];
+        if (dir > EVENT_RX || get_varint(buf, len, &pos, &delta) < 0 ||
+            get_varint(buf, len, &pos, &size) < 0 || size > len - pos) {
+            break; // truncated capture, replay what we have
+        }
+        if (p->count == events_cap) {
+            events_cap = events_cap ? events_cap * 2 : 256;
+            p->events = realloc(p->events, events_cap * sizeof(struct replay_event));
+        }
+        time_us += delta;
+        p->events[p->count++] = (struct replay_event){ dir, time_us, buf + pos, size };
+        pos += size;
+    }
+
+    transport *t = calloc(1, sizeof(transport));
+    t->fd = -1;
+    t->ops = &replay_ops;
+    t->priv = p;
+    return t;
+}
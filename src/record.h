@@ -0,0 +1,22 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include "transport.h"
+
+/*
+    Serial session capture
+
+    File: "MNREC" + version byte + 2 reserved, then one event per transfer:
+      u8      direction (0 host -> device, 1 device -> host)
+      varint  microseconds since previous event (monotonic clock)
+      varint  length
+      bytes
+*/
+
+// wraps inner, logging everything written and read to file
+transport *transport_record(transport *inner, const char *file);
+// plays a capture back, at recorded speed when realtime, else as fast as possible
+transport *transport_open_replay(const char *file, bool realtime);
+
+#endif
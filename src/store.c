@@ -0,0 +1,300 @@
+#include "store.h"
+#include "lz.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SURVEY_MAGIC 0x02
+#define SURVEY_HEADER_LEN 10
+#define SURVEY_SHOT_LEN 16
+#define SHOT_TYPE_EOC 3
+
+#define OBJECT_MAGIC "MNZ"
+#define OBJECT_HEADER_LEN 8
+#define OBJECT_RAW 0x00
+#define OBJECT_LZ 0x01
+
+#define MANIFEST_MAGIC "mnemo-manifest 1"
+
+/*
+    Return codes:
+    -1 io error (errno is set)
+    -2 corrupt object or manifest
+*/
+
+uint64_t store_hash(const uint8_t *data, size_t len) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+size_t survey_record_len(const uint8_t *data, size_t len) {
+    if (len < SURVEY_HEADER_LEN || data[0] != SURVEY_MAGIC) {
+        return len;
+    }
+    size_t n = SURVEY_HEADER_LEN;
+    while (n + SURVEY_SHOT_LEN <= len) {
+        uint8_t type = data[n];
+        n += SURVEY_SHOT_LEN;
+        if (type == SHOT_TYPE_EOC) {
+            return n;
+        }
+    }
+    // Truncated survey, keep the rest as one record
+    return len;
+}
+
+static int make_dir(const char *path) {
+    if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+int store_init(const char *root) {
+    char path[PATH_MAX];
+    if (make_dir(root) < 0) return -1;
+    snprintf(path, sizeof(path), "%s/objects", root);
+    if (make_dir(path) < 0) return -1;
+    snprintf(path, sizeof(path), "%s/manifests", root);
+    if (make_dir(path) < 0) return -1;
+    return 0;
+}
+
+static int read_file(const char *path, uint8_t **data, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    struct stat st;
+    if (fstat(fileno(f), &st) < 0) {
+        fclose(f);
+        return -1;
+    }
+    *len = st.st_size;
+    *data = malloc(*len ? *len : 1);
+    if (fread(*data, 1, *len, f) != *len) {
+        free(*data);
+        fclose(f);
+        errno = EIO;
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Writes to a temporary file next to path, caller moves it into place
+static int write_tmp(const char *path, char *tmp, size_t tmpsize, const uint8_t *data, size_t len) {
+    snprintf(tmp, tmpsize, "%s.tmp.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    if (fwrite(data, 1, len, f) != len) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    if (fclose(f) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void object_path(const char *root, uint64_t hash, char *dir, char *path) {
+    snprintf(dir, PATH_MAX, "%s/objects/%02x", root, (unsigned)(hash >> 56));
+    snprintf(path, PATH_MAX, "%s/%014llx", dir, (unsigned long long)(hash & 0x00ffffffffffffffULL));
+}
+
+static int load_object(const char *root, uint64_t hash, uint8_t **data, size_t *len) {
+    char dir[PATH_MAX], path[PATH_MAX];
+    object_path(root, hash, dir, path);
+
+    uint8_t *obj;
+    size_t objlen;
+    if (read_file(path, &obj, &objlen) < 0) return -1;
+
+    if (objlen < OBJECT_HEADER_LEN || memcmp(obj, OBJECT_MAGIC, 3) != 0) {
+        free(obj);
+        return -2;
+    }
+    uint8_t method = obj[3];
+    *len = (size_t)obj[4] | ((size_t)obj[5] << 8) | ((size_t)obj[6] << 16) | ((size_t)obj[7] << 24);
+    *data = malloc(*len ? *len : 1);
+
+    const uint8_t *payload = obj + OBJECT_HEADER_LEN;
+    size_t payload_len = objlen - OBJECT_HEADER_LEN;
+    ssize_t n = -1;
+    if (method == OBJECT_RAW && payload_len == *len) {
+        memcpy(*data, payload, payload_len);
+        n = payload_len;
+    } else if (method == OBJECT_LZ) {
+        n = lz_decompress(payload, payload_len, *data, *len);
+    }
+    free(obj);
+
+    if (n < 0 || (size_t)n != *len || store_hash(*data, *len) != hash) {
+        free(*data);
+        return -2;
+    }
+    return 0;
+}
+
+static int put_object(const char *root, const uint8_t *data, size_t len, struct store_stats *stats) {
+    uint64_t hash = store_hash(data, len);
+    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
+    object_path(root, hash, dir, path);
+
+    if (access(path, F_OK) == 0) {
+        uint8_t *old;
+        size_t oldlen;
+        int result = load_object(root, hash, &old, &oldlen);
+        if (result < 0) return result;
+        // Different content under the same hash, refuse rather than lose data
+        result = (oldlen == len && memcmp(old, data, len) == 0) ? 0 : -2;
+        free(old);
+        return result;
+    }
+
+    if (make_dir(dir) < 0) return -1;
+
+    size_t cap = OBJECT_HEADER_LEN + lz_bound(len);
+    uint8_t *obj = malloc(cap);
+    size_t n = lz_compress(data, len, obj + OBJECT_HEADER_LEN, cap - OBJECT_HEADER_LEN);
+    memcpy(obj, OBJECT_MAGIC, 3);
+    obj[3] = OBJECT_LZ;
+    if (n >= len) {
+        obj[3] = OBJECT_RAW;
+        memcpy(obj + OBJECT_HEADER_LEN, data, len);
+        n = len;
+    }
+    obj[4] = len & 0xff;
+    obj[5] = (len >> 8) & 0xff;
+    obj[6] = (len >> 16) & 0xff;
+    obj[7] = (len >> 24) & 0xff;
+
+    int result = write_tmp(path, tmp, sizeof(tmp), obj, OBJECT_HEADER_LEN + n);
+    free(obj);
+    if (result < 0) return -1;
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    stats->new_records++;
+    stats->bytes_stored += OBJECT_HEADER_LEN + n;
+    return 0;
+}
+
+// Publishes tmp under a new timestamp based name, link() fails if the name is taken
+static int publish_manifest(const char *root, const char *tmp, char *id) {
+    char path[PATH_MAX];
+    char stamp[32];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+
+    for (int i = 0; i < 1000; i++) {
+        if (i == 0) {
+            snprintf(id, STORE_ID_LEN, "%s", stamp);
+        } else {
+            snprintf(id, STORE_ID_LEN, "%s-%d", stamp, i);
+        }
+        snprintf(path, sizeof(path), "%s/manifests/%s", root, id);
+        if (link(tmp, path) == 0) {
+            unlink(tmp);
+            return 0;
+        }
+        if (errno != EEXIST) break;
+    }
+    unlink(tmp);
+    return -1;
+}
+
+int store_add(const char *root, const uint8_t *data, size_t len, char *id, struct store_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (store_init(root) < 0) return -1;
+
+    // 16 hex digits, space, length and newline per record
+    size_t cap = 64;
+    for (size_t off = 0; off < len; off += survey_record_len(data + off, len - off)) {
+        cap += 48;
+    }
+    char *manifest = malloc(cap);
+    size_t mlen = snprintf(manifest, cap, MANIFEST_MAGIC "\nsize %zu\n", len);
+
+    size_t off = 0;
+    while (off < len) {
+        size_t n = survey_record_len(data + off, len - off);
+        int result = put_object(root, data + off, n, stats);
+        if (result < 0) {
+            free(manifest);
+            return result;
+        }
+        mlen += snprintf(manifest + mlen, cap - mlen, "%016llx %zu\n",
+            (unsigned long long)store_hash(data + off, n), n);
+        stats->records++;
+        off += n;
+    }
+    stats->bytes_in = len;
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/manifests/new", root);
+    int result = write_tmp(path, tmp, sizeof(tmp), (uint8_t *)manifest, mlen);
+    free(manifest);
+    if (result < 0) return -1;
+    stats->bytes_stored += mlen;
+    return publish_manifest(root, tmp, id);
+}
+
+int store_export(const char *root, const char *id, uint8_t **data, size_t *len) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/manifests/%s", root, id);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char line[128];
+    size_t size = 0;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, MANIFEST_MAGIC "\n", sizeof(MANIFEST_MAGIC)) != 0 ||
+        !fgets(line, sizeof(line), f) || sscanf(line, "size %zu", &size) != 1) {
+        fclose(f);
+        return -2;
+    }
+
+    *data = malloc(size ? size : 1);
+    *len = 0;
+    int result = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long hash;
+        size_t n;
+        if (sscanf(line, "%16llx %zu", &hash, &n) != 2 || n > size - *len) {
+            result = -2;
+            break;
+        }
+        uint8_t *record;
+        size_t record_len;
+        result = load_object(root, hash, &record, &record_len);
+        if (result < 0) break;
+        if (record_len != n) {
+            free(record);
+            result = -2;
+            break;
+        }
+        memcpy(*data + *len, record, n);
+        *len += n;
+        free(record);
+    }
+    fclose(f);
+
+    if (result == 0 && *len != size) {
+        result = -2;
+    }
+    if (result < 0) {
+        free(*data);
+    }
+    return result;
+}
@@ -0,0 +1,37 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Content addressed survey store
+
+    <root>/objects/xx/yyyyyyyyyyyyyy   one compressed survey record, keyed by hash
+    <root>/manifests/<id>              ordered record list of one import
+
+    Records are stored once no matter how many imports contain them, a
+    manifest is enough to rebuild the original dump byte for byte.
+*/
+
+#define STORE_ID_LEN 64
+
+struct store_stats {
+    size_t records;
+    size_t new_records;
+    size_t bytes_in;
+    size_t bytes_stored;
+};
+
+uint64_t store_hash(const uint8_t *data, size_t len);
+// length of the survey record at the start of data (header + shots up to EOC)
+size_t survey_record_len(const uint8_t *data, size_t len);
+
+int store_init(const char *root);
+// splits a raw dump into records and writes a manifest, id receives the manifest name
+int store_add(const char *root, const uint8_t *data, size_t len, char *id, struct store_stats *stats);
+// rebuilds the raw dump of manifest id, user must free data
+int store_export(const char *root, const char *id, uint8_t **data, size_t *len);
+
+#endif
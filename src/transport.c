@@ -0,0 +1,272 @@
+#include "transport.h"
+#include "record.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static transport *transport_new(int fd, const struct transport_ops *ops, void *priv) {
+    transport *t = calloc(1, sizeof(transport));
+    t->fd = fd;
+    t->ops = ops;
+    t->priv = priv;
+    return t;
+}
+
+// Generic fd backend
+
+static ssize_t fd_write(transport *t, const void *buf, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(t->fd, (const uint8_t *)buf + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { t->fd, POLLOUT, 0 };
+                poll(&pfd, 1, 1000);
+                continue;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+static ssize_t fd_read(transport *t, void *buf, size_t len, size_t min, int timeout) {
+    struct pollfd pfd = { t->fd, POLLIN, 0 };
+    size_t got = 0;
+    if (min == 0) min = 1;
+    while (got < min) {
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ret == 0) break;
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            errno = EIO;
+            return -1;
+        }
+        ssize_t n = read(t->fd, (uint8_t *)buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        if (n == 0) break; // peer closed
+        got += n;
+    }
+    return got;
+}
+
+static int fd_drain(transport *t) {
+    return 0;
+}
+
+static void fd_close(transport *t) {
+    close(t->fd);
+}
+
+static const struct transport_ops fd_ops = {
+    .name = "fd",
+    .write = fd_write,
+    .read = fd_read,
+    .drain = fd_drain,
+    .close = fd_close,
+};
+
+transport *transport_open_fd(int fd) {
+    return transport_new(fd, &fd_ops, NULL);
+}
+
+transport *transport_open_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return NULL;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    return transport_open_fd(fd);
+}
+
+// Tuned termios backend
+
+struct tty_priv {
+    struct termios oldtio;
+    struct termios settings;
+#ifdef __linux__
+    struct serial_struct oldserial;
+    int has_serial;
+#endif
+};
+
+// Let the kernel wake us when the whole response is in instead of per usb packet
+static void tty_set_vmin(transport *t, size_t want) {
+    struct tty_priv *p = t->priv;
+    cc_t vmin = want > 255 ? 255 : (want == 0 ? 1 : want);
+    if (p->settings.c_cc[VMIN] == vmin) return;
+    p->settings.c_cc[VMIN] = vmin;
+    tcsetattr(t->fd, TCSANOW, &p->settings);
+}
+
+static ssize_t tty_read(transport *t, void *buf, size_t len, size_t min, int timeout) {
+    struct pollfd pfd = { t->fd, POLLIN, 0 };
+    size_t got = 0;
+    if (min == 0) min = 1;
+    while (got < min) {
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ret == 0) break;
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            errno = EIO;
+            return -1;
+        }
+        // Blocks until VMIN bytes or a VTIME gap after the first byte
+        tty_set_vmin(t, min - got);
+        ssize_t n = read(t->fd, (uint8_t *)buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        // Hung up (adapter unplugged), poll reports ready and read returns 0 from now on
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        got += n;
+    }
+    return got;
+}
+
+static int tty_drain(transport *t) {
+    return tcdrain(t->fd);
+}
+
+static void tty_close(transport *t) {
+    struct tty_priv *p = t->priv;
+    tcdrain(t->fd);
+#ifdef __linux__
+    if (p->has_serial) {
+        ioctl(t->fd, TIOCSSERIAL, &p->oldserial);
+    }
+#endif
+    tcsetattr(t->fd, TCSANOW, &p->oldtio);
+    close(t->fd);
+    free(p);
+}
+
+static const struct transport_ops tty_ops = {
+    .name = "tty",
+    .write = fd_write,
+    .read = tty_read,
+    .drain = tty_drain,
+    .close = tty_close,
+};
+
+transport *transport_open_tty(const char *tty, speed_t speed) {
+    // O_NDELAY so open doesn't wait for carrier, reads block on VMIN/VTIME after that
+    int fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY);
+    if (fd < 0) {
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    struct tty_priv *p = calloc(1, sizeof(struct tty_priv));
+    tcgetattr(fd, &p->oldtio);
+    p->settings.c_cflag = CS8 | CLOCAL | CREAD;
+    p->settings.c_cc[VMIN] = 1;
+    p->settings.c_cc[VTIME] = 1;
+    cfsetspeed(&p->settings, speed);
+    tcflush(fd, TCIFLUSH);
+    tcsetattr(fd, TCSANOW, &p->settings);
+
+#ifdef __linux__
+    // FTDI style adapters drop their latency timer to 1ms with this
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        p->oldserial = serial;
+        p->has_serial = 1;
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+#endif
+
+    return transport_new(fd, &tty_ops, p);
+}
+
+transport *transport_open(const char *name, speed_t speed) {
+    if (strncmp(name, "unix:", 5) == 0) {
+        return transport_open_socket(name + 5);
+    }
+    if (strncmp(name, "replay:", 7) == 0) {
+        return transport_open_replay(name + 7, false);
+    }
+    if (strncmp(name, "replay-realtime:", 16) == 0) {
+        return transport_open_replay(name + 16, true);
+    }
+    return transport_open_tty(name, speed);
+}
+
+ssize_t transport_write(transport *t, const void *buf, size_t len) {
+    if (t->write_ns == 0) {
+        t->write_ns = monotonic_ns();
+    }
+    return t->ops->write(t, buf, len);
+}
+
+ssize_t transport_read(transport *t, void *buf, size_t len, size_t min, int timeout) {
+    ssize_t n = t->ops->read(t, buf, len, min, timeout);
+    if (n > 0 && (size_t)n >= min && t->write_ns != 0) {
+        uint64_t rtt = monotonic_ns() - t->write_ns;
+        struct transport_stats *s = &t->stats;
+        if (s->round_trips == 0 || rtt < s->rtt_min_ns) s->rtt_min_ns = rtt;
+        if (rtt > s->rtt_max_ns) s->rtt_max_ns = rtt;
+        s->rtt_total_ns += rtt;
+        s->round_trips++;
+        t->write_ns = 0;
+    }
+    return n;
+}
+
+int transport_drain(transport *t) {
+    return t->ops->drain(t);
+}
+
+void transport_discard(transport *t, int quiet) {
+    uint8_t buf[256];
+    t->write_ns = 0;
+    while (transport_read(t, buf, sizeof(buf), 1, quiet) > 0);
+}
+
+void transport_close(transport *t) {
+    t->ops->close(t);
+    free(t);
+}
@@ -0,0 +1,63 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <termios.h>
+
+/*
+    Byte transport under the mnemo protocol code
+
+    - tty:    tuned termios (VMIN/VTIME per read, ASYNC_LOW_LATENCY on linux)
+    - socket: "unix:<path>", for talking to a simulator or pty bridge
+    - fd:     any pollable fd (pipe, pty, socketpair) for tests
+    - replay: "replay:<file>" / "replay-realtime:<file>", see record.h
+*/
+
+typedef struct transport transport;
+
+struct transport_stats {
+    uint32_t round_trips;
+    uint64_t rtt_total_ns;
+    uint64_t rtt_min_ns;
+    uint64_t rtt_max_ns;
+};
+
+struct transport_ops {
+    const char *name;
+    ssize_t (*write)(transport *t, const void *buf, size_t len);
+    // reads up to len bytes, returns once min bytes arrived or nothing arrived for timeout ms
+    ssize_t (*read)(transport *t, void *buf, size_t len, size_t min, int timeout);
+    // waits until written bytes left the host
+    int (*drain)(transport *t);
+    void (*close)(transport *t);
+};
+
+struct transport {
+    int fd;
+    const struct transport_ops *ops;
+    void *priv;
+    struct transport_stats stats;
+    uint64_t write_ns; // first unanswered write, 0 if none
+};
+
+uint64_t monotonic_ns(void);
+
+// "unix:<path>" connects to a socket, "replay:<file>" plays a capture,
+// anything else is opened as a tty
+transport *transport_open(const char *name, speed_t speed);
+transport *transport_open_tty(const char *tty, speed_t speed);
+transport *transport_open_socket(const char *path);
+// takes ownership of fd
+transport *transport_open_fd(int fd);
+
+ssize_t transport_write(transport *t, const void *buf, size_t len);
+// returns bytes read (less than min on timeout), -1 on error
+ssize_t transport_read(transport *t, void *buf, size_t len, size_t min, int timeout);
+int transport_drain(transport *t);
+// reads and drops input until nothing arrived for quiet ms
+void transport_discard(transport *t, int quiet);
+void transport_close(transport *t);
+
+#endif